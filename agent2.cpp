@@ -133,6 +133,8 @@ void Mothership_complex::on_request_action() {
     JDBG_L < sim_state.orig().strategy.p_tasks() ,0;
 
     jout << "Searched " << strategies.size() << " strategies, with max " << best_value << endl;
+    auto const& dc = sim_state.dist_cache;
+    jout << "Reused " << dc.reused << " of " << dc.reused + dc.computed << " agent distances" << endl;
     
     std::memcpy(&sit().strategy, &sim_state.sit().strategy, sizeof(sit().strategy));
 
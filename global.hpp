@@ -17,7 +17,9 @@
 
 // lampe general headers
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <csignal>
 #include <cstdint>
 #include <cstdlib>
@@ -42,6 +44,11 @@
 #include <utility>
 #include <vector>
 
+// x86 vector intrinsics, see Graph::dist_air_batch
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 // pugixml headers
 #include "pugixml.hpp"
 
@@ -13,32 +13,33 @@ struct GH_Edge {
 	s32 nodea, nodeb, linka, linkb, dist, flags, geo, name;
 };
 
-Node_range const Node::iter(Graph const& graph) const {
-	assert(graph.m_data.inside(this));
-	return Node_range{ &graph, (u32)(this - &graph.nodes()[0]), edge };
-}
+// The size of the header of a GraphHopper file, the records start directly behind it
+static constexpr int gh_header_size = 100;
 
-Edge_iterator Node_range::begin() const {
-	assert(graph and node != node_invalid and edge != edge_invalid);
-	bool is_nodea = edge != edge_invalid and graph->edges()[edge].nodea == node;
-	return Edge_iterator{ graph, edge, is_nodea };
-}
+/**
+ * Reads the big-endian header fields of a GraphHopper file from memory.
+ */
+struct GH_reader {
+	u8 const* ptr;
 
-Edge_iterator Node_range::end() const {
-	return Edge_iterator{};
-}
+	GH_reader(char const* ptr): ptr{(u8 const*)ptr} {}
 
-Edge const& Edge_iterator::operator*() const {
-	assert(graph and edge != edge_invalid);
-	return graph->edges()[edge];
-}
-Edge_iterator& Edge_iterator::operator++() {
-	Edge const& e = **this;
-	u32 node = is_nodea ? e.nodea : e.nodeb;
-	edge = is_nodea ? e.linka : e.linkb;
-	is_nodea = edge != edge_invalid and (**this).nodea == node;
-	return *this;
-}
+	s16 read16() {
+		s16 r = (s16)(ptr[0] << 8 | ptr[1]);
+		ptr += 2;
+		return r;
+	}
+	s32 read32() {
+		u32 r = 0;
+		for (u8 i = 0; i < 4; ++i) r = (r << 8) | *ptr++;
+		return (s32)r;
+	}
+	s64 read64() {
+		u64 r = 0;
+		for (u8 i = 0; i < 8; ++i) r = (r << 8) | *ptr++;
+		return (s64)r;
+	}
+};
 
 // The conversion between GH s32 degrees and actual doubles
 static constexpr double int_deg_fac = std::numeric_limits<s32>::max() / 400.0;
@@ -79,32 +80,90 @@ std::pair<double, double> Graph::get_pos_back(Pos pos) const {
 	return{ lat, lon };
 }
 
+/**
+ * Append the difference of two coordinates as zigzag varint, so that small differences of either
+ * sign take a single byte.
+ */
+static void append_varint(Buffer* data, s32 delta) {
+	u32 value = (u32)delta << 1 ^ (u32)(delta >> 31);
+	while (value >= 0x80) {
+		data->emplace_back<u8>((u8)(value | 0x80));
+		value >>= 7;
+	}
+	data->emplace_back<u8>((u8)value);
+}
+
+/**
+ * Read a difference written by append_varint and advance ptr behind it.
+ */
+static s32 read_varint(u8 const** ptr) {
+	u32 value = 0;
+	for (u32 shift = 0;; shift += 7) {
+		u8 byte = *(*ptr)++;
+		value |= (u32)(byte & 0x7f) << shift;
+		if (not (byte & 0x80)) break;
+	}
+	return (s32)(value >> 1) ^ -(s32)(value & 1);
+}
+
+int Graph::edge_points(u32 edge, Pos* out) const {
+	auto const& e = edges_hot()[edge];
+	assert(e.nodea != node_invalid and e.nodeb != node_invalid);
+	auto geo = geometry(edge);
+	u8 const* ptr = (u8 const*)geo.begin();
+	u8 const* end = (u8 const*)geo.end();
+
+	int n = 0;
+	Pos p = out[n++] = nodes()[e.nodea].pos;
+	while (ptr < end) {
+		p.lat = (u16)(p.lat + read_varint(&ptr));
+		p.lon = (u16)(p.lon + read_varint(&ptr));
+		assert(n < max_edge_points - 1);
+		out[n++] = p;
+	}
+	assert(ptr == end);
+	out[n++] = nodes()[e.nodeb].pos;
+	return n;
+}
+
+void Graph::edge_segment(u32 edge, int i, Pos* a, Pos* b) const {
+	auto const& e = edges_hot()[edge];
+	assert(e.nodea != node_invalid and e.nodeb != node_invalid and i >= 1);
+	auto geo = geometry(edge);
+	u8 const* ptr = (u8 const*)geo.begin();
+	u8 const* end = (u8 const*)geo.end();
+
+	Pos p = nodes()[e.nodea].pos;
+	for (int n = 1; n < i; ++n) {
+		assert(ptr < end);
+		p.lat = (u16)(p.lat + read_varint(&ptr));
+		p.lon = (u16)(p.lon + read_varint(&ptr));
+	}
+	*a = p;
+	if (ptr < end) {
+		p.lat = (u16)(p.lat + read_varint(&ptr));
+		p.lon = (u16)(p.lon + read_varint(&ptr));
+		*b = p;
+	} else {
+		*b = nodes()[e.nodeb].pos;
+	}
+}
+
 Pos Graph_position::pos(Graph const& graph) const {
 
 	if (is_node()) {
-		return graph.nodes()[id].pos;
+		return graph.nodes()[graph.node_internal(id)].pos;
 	} else {
-		auto const& edge = graph.edges()[id];
-		u8 n = edge.geo ? graph.geometry(edge.geo).size() + 1 : 1;
-		auto pos_pillar = std::make_unique<Pos[]>(n + 1);
-		auto dist_pillar = std::make_unique<float[]>(n + 1);
-		u8 i = 0;
-		pos_pillar[0] = graph.nodes()[edge.nodea].pos;
-		for (Pos p : graph.geometry(edge.geo)) {
-			pos_pillar[++i] = p;
-		}
-		pos_pillar[++i] = graph.nodes()[edge.nodeb].pos;
-		assert(i == n);
-		float d = 0;
-		dist_pillar[0] = 0.f;
-		for (u8 i = 1; i <= n; ++i) {
-			dist_pillar[i] = d += graph.dist_air(pos_pillar[i - 1], pos_pillar[i]);
-		}
-		d *= get_edge_pos();
-		i = 0;
-		while (dist_pillar[++i] < d);
-		auto a = pos_pillar[i - 1], b = pos_pillar[i];
-		auto r = (d - dist_pillar[i - 1]) / (dist_pillar[i] - dist_pillar[i - 1]),
+		u32 edge = graph.edge_internal(id);
+		auto lengths = graph.edge_lengths(edge);
+		assert(lengths.size());
+		float d = lengths[lengths.size() - 1] * get_edge_pos();
+		// the first point at least d along the edge, lengths[i - 1] belongs to point i
+		int i = std::lower_bound(lengths.begin(), lengths.end(), d) - lengths.begin() + 1;
+		float da = i > 1 ? lengths[i - 2] : 0.f, db = lengths[i - 1];
+		Pos a, b;
+		graph.edge_segment(edge, i, &a, &b);
+		auto r = (d - da) / (db - da),
 			s = 1.f - r;
 		assert(0 <= r and r <= 1);
 		return{ (u16)(a.lat * s + b.lat * r), (u16)(a.lon * s + b.lon * r) };
@@ -128,6 +187,142 @@ float Graph::dist_air(Pos const a, Pos const b) const {
 	return sqrt(dlat*dlat + dlon*dlon);
 }
 
+/**
+ * The implementations of dist_air_batch. They do the same operations as dist_air in the same
+ * order, except that the compiler may contract a multiply and an add differently.
+ */
+static void dist_air_scalar(Pos const a, float scale_lat, float scale_lon, u16 const* lat,
+		u16 const* lon, int n, float* out) {
+	for (int i = 0; i < n; ++i) {
+		float dlat = (a.lat - lat[i]) * scale_lat;
+		float dlon = (a.lon - lon[i]) * scale_lon;
+		out[i] = sqrt(dlat*dlat + dlon*dlon);
+	}
+}
+
+#ifdef __SSE2__
+
+static void dist_air_sse2(Pos const a, float scale_lat, float scale_lon, u16 const* lat,
+		u16 const* lon, int n, float* out) {
+	__m128i alat = _mm_set1_epi32(a.lat), alon = _mm_set1_epi32(a.lon), zero = _mm_setzero_si128();
+	__m128 slat = _mm_set1_ps(scale_lat), slon = _mm_set1_ps(scale_lon);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i blat = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i const*)(lat + i)), zero);
+		__m128i blon = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i const*)(lon + i)), zero);
+		__m128 dlat = _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(alat, blat)), slat);
+		__m128 dlon = _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(alon, blon)), slon);
+		_mm_storeu_ps(out + i, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dlat, dlat), _mm_mul_ps(dlon, dlon))));
+	}
+	dist_air_scalar(a, scale_lat, scale_lon, lat + i, lon + i, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static void dist_air_avx2(Pos const a, float scale_lat, float scale_lon, u16 const* lat,
+		u16 const* lon, int n, float* out) {
+	__m256i alat = _mm256_set1_epi32(a.lat), alon = _mm256_set1_epi32(a.lon);
+	__m256 slat = _mm256_set1_ps(scale_lat), slon = _mm256_set1_ps(scale_lon);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i blat = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const*)(lat + i)));
+		__m256i blon = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const*)(lon + i)));
+		__m256 dlat = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(alat, blat)), slat);
+		__m256 dlon = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(alon, blon)), slon);
+		_mm256_storeu_ps(out + i, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dlat, dlat),
+			_mm256_mul_ps(dlon, dlon))));
+	}
+	dist_air_sse2(a, scale_lat, scale_lon, lat + i, lon + i, n - i, out + i);
+}
+
+#endif
+
+void Graph::dist_air_batch(Pos const a, u16 const* lat, u16 const* lon, int n, float* out) const {
+	using Kernel = void (*)(Pos, float, float, u16 const*, u16 const*, int, float*);
+#ifdef __SSE2__
+	static Kernel const kernel = __builtin_cpu_supports("avx2") ? dist_air_avx2 : dist_air_sse2;
+#else
+	static Kernel const kernel = dist_air_scalar;
+#endif
+	kernel(a, map_scale_lat, map_scale_lon, lat, lon, n, out);
+}
+
+void Pos_cache::reset() {
+	entries.free();
+	hits = misses = 0;
+}
+
+Graph_position Graph::pos_cached(Pos const pos) const {
+	auto& e = pos_cache.slot(pos);
+	if (e.used and e.pos.lat == pos.lat and e.pos.lon == pos.lon) {
+		++pos_cache.hits;
+		return e.result;
+	}
+	++pos_cache.misses;
+	e = {pos, this->pos(pos), true};
+	return e.result;
+}
+
+void Graph::nearest_nodes(Pos const pos, std::pair<float, u32>* best, int count) const {
+	assert(count > 0);
+	constexpr float const dist_invalid = std::numeric_limits<float>::max();
+	for (int i = 0; i < count; ++i) best[i] = { dist_invalid, node_invalid };
+	// tower nodes, in growing rings of grid cells around pos, until the cells outside are further
+	// away than the nodes found
+	int row = std::min(std::max(pos.lat - pos_grid_min.lat, 0) >> pos_grid_shift, pos_grid_rows - 1);
+	int col = std::min(std::max(pos.lon - pos_grid_min.lon, 0) >> pos_grid_shift, pos_grid_cols - 1);
+	auto const& grid_index = get<Arc_index_t>(pos_grid_index_offset);
+	auto const& grid_ids = get<Ids_t>(pos_grid_offset);
+	auto const& grid_lat = get<Coords_t>(pos_grid_lat_offset);
+	auto const& grid_lon = get<Coords_t>(pos_grid_lon_offset);
+	static thread_local std::vector<float> dists;
+	// the cells of a row are stored next to each other, so a run of them is measured in one batch
+	auto scan = [&](int i, int j0, int j1) {
+		j0 = std::max(j0, 0);
+		j1 = std::min(j1, pos_grid_cols - 1);
+		if (j0 > j1) return;
+		u32 begin = grid_index[i * pos_grid_cols + j0], end = grid_index[i * pos_grid_cols + j1 + 1];
+		dists.resize(end - begin);
+		dist_air_batch(pos, grid_lat.begin() + begin, grid_lon.begin() + begin, end - begin, dists.data());
+		for (u32 k = begin; k < end; ++k) {
+			std::pair<float, u32> c = { dists[k - begin], grid_ids[k] };
+			if (c < best[count - 1]) {
+				best[count - 1] = c;
+				std::sort(best, best + count);
+			}
+		}
+	};
+	for (int r = 0;; ++r) {
+		for (int i = std::max(row - r, 0); i <= std::min(row + r, pos_grid_rows - 1); ++i) {
+			// only the first and last row of the ring are complete
+			if (r == 0 or i == row - r or i == row + r) {
+				scan(i, col - r, col + r);
+			} else {
+				scan(i, col - r, col - r);
+				scan(i, col + r, col + r);
+			}
+		}
+		float outside = dist_invalid;
+		if (row - r > 0) {
+			int lat = pos_grid_min.lat + ((row - r) << pos_grid_shift);
+			outside = std::min(outside, std::abs((pos.lat - lat) * map_scale_lat));
+		}
+		if (row + r < pos_grid_rows - 1) {
+			int lat = pos_grid_min.lat + ((row + r + 1) << pos_grid_shift);
+			outside = std::min(outside, std::abs((lat - pos.lat) * map_scale_lat));
+		}
+		if (col - r > 0) {
+			int lon = pos_grid_min.lon + ((col - r) << pos_grid_shift);
+			outside = std::min(outside, std::abs((pos.lon - lon) * map_scale_lon));
+		}
+		if (col + r < pos_grid_cols - 1) {
+			int lon = pos_grid_min.lon + ((col + r + 1) << pos_grid_shift);
+			outside = std::min(outside, std::abs((lon - pos.lon) * map_scale_lon));
+		}
+		// leave some room for rounding errors of dist_air
+		if (outside == dist_invalid or best[count - 1].first < outside * 0.999f) break;
+	}
+}
+
 Graph_position Graph::pos(Pos const pos) const {
 
 	constexpr float const dist_invalid = std::numeric_limits<float>::max();
@@ -142,65 +337,41 @@ Graph_position Graph::pos(Pos const pos) const {
 	bool is_node = true;
 
 	std::pair<float, u32> best[bsize];
-	for (u8 i = 0; i < bsize; ++i) best[i] = { dist_invalid, node_invalid };
-	// tower nodes
-	for (u32 node_id = 0; node_id < nodes().size(); ++node_id) {
-		auto const& node = nodes()[node_id];
-		if (node.edge == edge_invalid) continue;
-		auto d = dist_air(pos, node.pos);
-		std::pair<float, u32> c = { d, node_id };
-		if (c < best[bsize - 1]) {
-			best[bsize - 1] = c;
-			std::sort(best, best + bsize);
-		}
-		if (d < min) {
-			min = d;
-			id = node_id;
-		}
-	}
-
-	// edges
-	for (u32 edge_id = 0; edge_id < edges().size(); ++edge_id) {
-		auto const& edge = edges()[edge_id];
-		if (edge.nodea == edge_invalid or edge.nodeb == edge_invalid) continue;
-		bool b = false;
-		for (u8 i = 0; i < bsize; ++i) {
-			auto n = best[i].second;
-			if (edge.nodea == n or edge.nodeb == n) {
-				b = true;
-				break;
-			}
-		}
-		if (!b) continue;
-		u8 n = edge.geo ? geometry(edge.geo).size() + 2 : 2;
-		auto pos_node = std::make_unique<Pos[]>(n);
-		pos_node[0];
-		auto dist_node = std::make_unique<float[]>(n);
-		u8 i = 0;
-		Pos a = pos_node[i++] = nodes()[edge.nodea].pos;
-		for (Pos p : geometry(edge.geo)) {
-			pos_node[i++] = p;
-		}
-		pos_node[i++] = nodes()[edge.nodeb].pos;
-		assert(i == n);
-		float ed = 0;
-		dist_node[0] = 0.f;
-		for (u8 i = 1; i < n; ++i) {
-			dist_node[i] = ed += dist_air(pos_node[i - 1], pos_node[i]);
-		}
+	nearest_nodes(pos, best, bsize);
+	// the same node as found by a scan in the order of the ids, as the ties are broken by id
+	min = best[0].first;
+	id = best[0].second;
+
+	// edges of the nearest nodes, in the order of their ids
+	static thread_local std::vector<u32> candidates;
+	candidates.clear();
+	for (u8 i = 0; i < bsize; ++i) {
+		if (best[i].second == node_invalid) continue;
+		auto edges = node_edges(best[i].second);
+		candidates.insert(candidates.end(), edges.begin(), edges.end());
+	}
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	for (u32 edge_id: candidates) {
+		Pos pos_node[max_edge_points];
+		int n = edge_points(edge_id, pos_node);
+		auto lengths = edge_lengths(edge_id);
+		assert(lengths.size() == n - 1);
+		auto dist_node = [&lengths](int i) { return i ? lengths[i - 1] : 0.f; };
+		float ed = lengths[n - 2];
 		// pillar nodes
-		for (u8 i = 1; i < n - 1; ++i) {
+		for (int i = 1; i < n - 1; ++i) {
 			float d = dist_air(pos, pos_node[i]) + edge_penalty;
 			if (d < min) {
 				min = d;
 				id = edge_id;
-				edge_pos = dist_node[i] / ed;
+				edge_pos = dist_node(i) / ed;
 				is_node = false;
 			}
 		}
 
-		a = pos_node[0];
-		for (u8 i = 1; i < n; ++i) {
+		Pos a = pos_node[0];
+		for (int i = 1; i < n; ++i) {
 			// line between two nodes
 			Pos b = pos_node[i];
 			float dlat = (b.lat - a.lat) * map_scale_lat,
@@ -216,7 +387,7 @@ Graph_position Graph::pos(Pos const pos) const {
 				if (d < min) {
 					min = d;
 					id = edge_id;
-					edge_pos = (dist_node[i - 1] + r * (dist_node[i] - dist_node[i - 1])) / ed;
+					edge_pos = (dist_node(i - 1) + r * (dist_node(i) - dist_node(i - 1))) / ed;
 					is_node = false;
 				}
 			}
@@ -225,219 +396,352 @@ Graph_position Graph::pos(Pos const pos) const {
 	}
 
 	if (is_node) {
-		return{ id, (u8)0 };
+		return to_external({ id, (u8)0 });
 	} else {
-		return{ id, edge_pos };
+		return to_external({ id, edge_pos });
 	}
 }
 
-u32 Graph::dist_road(Graph_position const s, Graph_position const t, Buffer* into) const {
-	// bidirectional
-	constexpr auto const dist_invalid = std::numeric_limits<u32>::max();
-	// underestimate rounding error correction
-	constexpr auto const dist_margin = 2000.f;
+void Dist_heap::reset(u32 nnodes) {
+	for (auto const& item: items) index[item.node] = not_queued;
+	items.reset();
+	if (index.size() < (int)nnodes) {
+		int old = index.size();
+		index.resize(nnodes);
+		for (int i = old; i < index.size(); ++i) index[i] = not_queued;
+	}
+}
 
-	if (s.is_node() and t.is_node() and s.id == t.id) {
-		if (into) {
-			int route_ofs = into->size();
-			into->emplace_back<Route_t>();
-			into->get<Route_t>(route_ofs).init(into);
-			into->get<Route_t>(route_ofs).push_back(s.id, into);
+Dist_heap::Item Dist_heap::pop() {
+	assert(not empty());
+	Item result = items[0];
+	index[result.node] = not_queued;
+	Item last = items.pop_back();
+	if (not empty()) sift_down(0, last);
+	return result;
+}
+
+void Dist_heap::push(u32 node, u32 dist) {
+	u32 i = index[node];
+	if (i == not_queued) {
+		i = items.size();
+		items.addsize(1);
+	} else {
+		assert(dist <= items[i].dist);
+	}
+	sift_up(i, { dist, node });
+}
+
+void Dist_heap::sift_up(int i, Item item) {
+	// move the hole at i upwards until item fits into it
+	while (i > 0) {
+		int parent = (i - 1) / 4;
+		if (items[parent].dist <= item.dist) break;
+		items[i] = items[parent];
+		index[items[i].node] = i;
+		i = parent;
+	}
+	items[i] = item;
+	index[item.node] = i;
+}
+
+void Dist_heap::sift_down(int i, Item item) {
+	int n = items.size();
+	while (true) {
+		int first = 4 * i + 1;
+		if (first >= n) break;
+		int best = first;
+		for (int j = first + 1; j < first + 4 and j < n; ++j) {
+			if (items[j].dist < items[best].dist) best = j;
 		}
-		return 0;
+		if (item.dist <= items[best].dist) break;
+		items[i] = items[best];
+		index[items[i].node] = i;
+		i = best;
+	}
+	items[i] = item;
+	index[item.node] = i;
+}
+
+void Search_workspace::reset(u32 nnodes) {
+	heapf.reset(nnodes);
+	heapb.reset(nnodes);
+	++epoch;
+	if (entries.size() < (int)nnodes or epoch == 0) {
+		// the stamps are cleared when the epoch wraps around, so that no old entry looks current
+		int old = epoch == 0 ? 0 : entries.size();
+		entries.resize(std::max(entries.size(), (int)nnodes));
+		for (int i = old; i < entries.size(); ++i) entries[i].epoch = 0;
+		if (epoch == 0) epoch = 1;
+	}
+}
+
+/**
+ * Walk from the position along its chain in both directions (or towards it, if reverse), writing
+ * the result into into. Its ends are the overlay nodes where a search starts. Positions on an
+ * overlay node, or on an edge between two of them, are treated as a chain of their own.
+ */
+static void chain_reach(Graph const& g, Graph_position pos, bool reverse, Chain_reach* into) {
+	into->nodes.clear();
+	into->dist.clear();
+	into->chain = chain_invalid;
+	if (pos.is_node() and g.in_overlay(pos.id)) {
+		into->nodes.push_back(pos.id);
+		into->dist.push_back(0);
+		into->ia = into->ib = 0;
+		return;
+	}
+
+	u32 edge = edge_invalid;
+	if (pos.is_node()) {
+		into->chain = g.node_chain(pos.id);
+	} else {
+		edge = pos.id;
+		auto const& e = g.edges_hot()[edge];
+		into->chain = g.in_overlay(e.nodea) ? g.node_chain(e.nodeb) : g.node_chain(e.nodea);
+	}
+	Array_view<u32> edges {&edge, 1};
+	u32 first = edge != edge_invalid ? g.edges_hot()[edge].nodea : node_invalid;
+	if (into->chain != chain_invalid) {
+		edges = g.chain_edges(into->chain);
+		first = g.chains()[into->chain].nodea;
+		// edges that may not be travelled at all are not part of any chain
+		if (edge != edge_invalid and edges.index(edge) == -1) {
+			edges = {&edge, 1};
+			first = g.edges_hot()[edge].nodea;
+			into->chain = chain_invalid;
+		}
+	}
+	auto& nodes = into->nodes;
+	auto& dist = into->dist;
+	nodes.push_back(first);
+	for (u32 i: edges) {
+		auto const& e = g.edges_hot()[i];
+		nodes.push_back(e.nodea == nodes.back() ? e.nodeb : e.nodea);
+	}
+	dist.assign(nodes.size(), dist_invalid);
+
+	// whether the search may go from nodes[i] to nodes[i+1], or the other way
+	auto passable = [&](int i, bool towards_b) {
+		auto const& e = g.edges_hot()[edges[i]];
+		bool from_nodea = (e.nodea == nodes[i]) == towards_b;
+		return e.flags & (from_nodea != reverse ? 1 : 2);
+	};
+	if (pos.is_node()) {
+		into->ia = into->ib = std::find(nodes.begin(), nodes.end(), (u32)pos.id) - nodes.begin();
+		assert(into->ia < (int)nodes.size());
+		dist[into->ia] = 0;
+	} else {
+		into->ia = edges.index(edge);
+		into->ib = into->ia + 1;
+		auto const& e = g.edges_hot()[edge];
+		u32 dist_a = (u32)(pos.get_edge_pos() * e.dist);
+		u32 dist_b = (u32)((1.f - pos.get_edge_pos()) * e.dist);
+		if (e.nodea != nodes[into->ia]) std::swap(dist_a, dist_b);
+		if (passable(into->ia, false)) dist[into->ia] = dist_a;
+		if (passable(into->ia, true )) dist[into->ib] = dist_b;
+	}
+	for (int i = into->ia - 1; i >= 0 and dist[i + 1] != dist_invalid and passable(i, false); --i) {
+		dist[i] = dist[i + 1] + g.edges_hot()[edges[i]].dist;
+	}
+	for (int i = into->ib; i < edges.size() and dist[i] != dist_invalid and passable(i, true); ++i) {
+		dist[i + 1] = dist[i] + g.edges_hot()[edges[i]].dist;
 	}
+}
+
+/**
+ * Returns the distance between two internal positions on the same node, or on the same edge with t
+ * ahead of s, without searching. Otherwise returns dist_invalid.
+ */
+static u32 dist_trivial(Graph const& g, Graph_position s, Graph_position t) {
+	if (s.is_node() and t.is_node() and s.id == t.id) return 0;
 	if (s.is_edge() and t.is_edge() and s.id == t.id) {
-		auto& edge = edges()[s.id];
+		auto const& edge = g.edges_hot()[s.id];
 		if (((s.edge_pos <= t.edge_pos) and (edge.flags & 1)) or ((s.edge_pos >= t.edge_pos) and (edge.flags & 2))) {
-			if (into) {
-				int route_ofs = into->size();
-				into->emplace_back<Route_t>();
-				into->get<Route_t>(route_ofs).init(into);
-			}
-			return abs(s.get_edge_pos() - t.get_edge_pos()) * edges()[s.id].dist;
+			return abs(s.get_edge_pos() - t.get_edge_pos()) * edge.dist;
 		}
 	}
-	
-	auto spos = s.pos(*this);
-	auto tpos = t.pos(*this);
-	auto estimatef = [this, tpos](u32 const node) -> u32 {
-		assert(node != node_invalid);
-		float d = dist_air(tpos, nodes()[node].pos) * 1000.f - dist_margin;
-		if (d < 0) return 0;
-		return (u32)d;
-	};
-	auto estimateb = [this, spos](u32 const node) -> u32 {
-		assert(node != node_invalid);
-		float d = dist_air(spos, nodes()[node].pos) * 1000.f - dist_margin;
-		if (d < 0) return 0;
-		return (u32)d;
-	};
-	auto nnodes = nodes().size();
-	Buffer buf;
-	// upper bounds for node distances
-	auto distf = std::make_unique<u32[]>(nnodes);
-	auto distb = std::make_unique<u32[]>(nnodes);
-	auto prev = std::make_unique<u32[]>(nnodes);
-	auto next = std::make_unique<u32[]>(nnodes);
-	auto visitedf = std::make_unique<u32[]>(nnodes / 8 + 1);
-	auto visitedb = std::make_unique<u32[]>(nnodes / 8 + 1);
-	for (u32 i = 0; i < nnodes; ++i) {
-		distf[i] = dist_invalid;
-		distb[i] = dist_invalid;
-		prev[i] = edge_invalid;
-		next[i] = edge_invalid;
+	return dist_invalid;
+}
+
+/**
+ * Run a complete search upwards in the hierarchy (downwards, if reverse) from the ends of the chain
+ * in reach, and call fn(node, dist) for each node it settles.
+ */
+template <typename Fn>
+static void ch_search(Graph const& g, Search_workspace* ws, Chain_reach const& reach, bool reverse,
+		Fn const& fn) {
+	ws->reset(g.nodes().size());
+	auto& heap = ws->heapf;
+	for (int end: { 0, (int)reach.nodes.size() - 1 }) {
+		if (reach.dist[end] == dist_invalid) continue;
+		auto& e = (*ws)[reach.nodes[end]];
+		if (reach.dist[end] < e.distf) heap.push(reach.nodes[end], e.distf = reach.dist[end]);
 	}
-	for (u32 i = 0; i * 8 < nnodes; ++i) {
-		visitedf[i] = 0;
-		visitedb[i] = 0;
+	while (not heap.empty()) {
+		auto el = heap.pop();
+		fn(el.node, el.dist);
+		for (auto const& arc: reverse ? g.ch_arcs_down(el.node) : g.ch_arcs_up(el.node)) {
+			u32 d = el.dist + arc.dist;
+			auto& e = (*ws)[arc.node];
+			if (d >= e.distf) continue;
+			heap.push(arc.node, e.distf = d);
+		}
 	}
-	auto setvf = [&visitedf](u32 id) {
-		visitedf[id >> 3] |= 1 << (id & 7);
-	};
-	auto getvf = [&visitedf](u32 id) -> bool {
-		return visitedf[id >> 3] & 1 << (id & 7);
-	};
-	auto setvb = [&visitedb](u32 id) {
-		visitedb[id >> 3] |= 1 << (id & 7);
-	};
-	auto getvb = [&visitedb](u32 id) -> bool {
-		return visitedb[id >> 3] & 1 << (id & 7);
-	};
+}
 
-	// total distance underestimate with associated node for forward search
-	auto ringf = std::set<std::pair<u32, u32>>();
-	if (s.is_edge()) {
-		auto const& es = edges()[s.id];
-		assert(es.nodea != node_invalid and es.nodeb != node_invalid);
-		if (es.flags & 2)
-			ringf.insert({ (distf[es.nodea] = (u32)(s.get_edge_pos() * es.dist)) + estimatef(es.nodea), es.nodea });
-		if (es.flags & 1)
-			ringf.insert({ (distf[es.nodeb] = (u32)((1.f - s.get_edge_pos()) * es.dist)) + estimatef(es.nodeb), es.nodeb });
+/**
+ * Returns the length of the shortest path from the position of reach_s to that of reach_t that
+ * stays on their common chain, or dist_invalid. Writes the index of a node on that path into mid.
+ */
+static u32 chain_direct(Chain_reach const& reach_s, Chain_reach const& reach_t, int* mid) {
+	u32 result = dist_invalid;
+	if (reach_s.chain == chain_invalid or reach_s.chain != reach_t.chain) return result;
+	for (int i = 0; i < (int)reach_s.nodes.size(); ++i) {
+		if (reach_s.dist[i] == dist_invalid or reach_t.dist[i] == dist_invalid) continue;
+		if (reach_s.dist[i] + reach_t.dist[i] < result) {
+			result = reach_s.dist[i] + reach_t.dist[i];
+			*mid = i;
+		}
+	}
+	return result;
+}
+
+/**
+ * Calls fn with the nodes along the arc of the contraction hierarchy, starting behind from and
+ * ending with the other end of the arc.
+ */
+template <typename Fn>
+static void ch_unpack(Graph const& g, u32 ref, u32 from, Fn const& fn) {
+	if (ref & ch_shortcut) {
+		auto const& shortcut = g.shortcuts()[ref & ~ch_shortcut];
+		assert(shortcut.from == from);
+		ch_unpack(g, shortcut.first, from, fn);
+		ch_unpack(g, shortcut.second, shortcut.middle, fn);
 	} else {
-		distf[s.id] = 0;
-		ringf.insert({ estimatef(s.id), s.id });
-	}
-
-	// total distance underestimate with associated node for backward search
-	auto ringb = std::set<std::pair<u32, u32>>();
-	if (t.is_edge()) {
-		auto const& et = edges()[t.id];
-		assert(et.nodea != node_invalid and et.nodeb != node_invalid);
-		if (et.flags & 1)
-			ringb.insert({ (distb[et.nodea] = (u32)(t.get_edge_pos() * et.dist)) + estimateb(et.nodea), et.nodea });
-		if (et.flags & 2)
-			ringb.insert({ (distb[et.nodeb] = (u32)((1.f - t.get_edge_pos()) * et.dist)) + estimateb(et.nodeb), et.nodeb });
+		g.chain_walk(ref, from, fn);
+		auto const& chain = g.chains()[ref];
+		fn(chain.nodea == from ? chain.nodeb : chain.nodea);
+	}
+}
+
+/**
+ * Return the other end of an arc of the contraction hierarchy.
+ */
+static u32 ch_other(Graph const& g, u32 ref, u32 node) {
+	if (ref & ch_shortcut) {
+		auto const& shortcut = g.shortcuts()[ref & ~ch_shortcut];
+		return shortcut.from == node ? shortcut.to : shortcut.from;
 	} else {
-		distb[t.id] = 0;
-		ringb.insert({ estimateb(t.id), t.id });
+		auto const& chain = g.chains()[ref];
+		return chain.nodea == node ? chain.nodeb : chain.nodea;
 	}
+}
 
-	// middle node of incumbent best path
-	auto midnode = node_invalid;
-	// (upper bound for) length of best path
-	auto inc = dist_invalid;
-	while (true) {
-		if (ringf.empty()) break;
-		auto elf = ringf.begin();
-		if (elf->first >= inc) break;
-		auto nodef = elf->second;
-		// bidirectional paths meet
-		if (getvb(nodef)) {
-			assert(distb[nodef] != dist_invalid);
-			auto d = distf[nodef] + distb[nodef];
-			if (d < inc) {
-				// update incumbent
-				midnode = nodef;
-				inc = d;
-				if (t.is_node() and (u32)t.id == nodef) break;
-			}
-		} else {
-			setvf(nodef);
-			auto const& rangef = nodes()[nodef].iter(*this);
-			for (auto it = rangef.begin(); it != rangef.end(); ++it) {
-				// skip misaligned one-way streets
-				u32 flags = edges()[it.edge].flags;
-				if (it.is_nodea and (flags & 1) == 0) continue;
-				if (!it.is_nodea and (flags & 2) == 0) continue;
-
-				auto other = it.is_nodea ? it->nodeb : it->nodea;
-				assert(other != node_invalid);
-				auto newdist = distf[nodef] + it->dist;
-				//assert(newdist > estimateb(other));
-
-				if (newdist < distf[other]) {
-					auto e = estimatef(other);
-					// check against upper bound
-					if (newdist + e < inc) {
-						if(distf[other] == dist_invalid) ringf.insert({ newdist + e, other });
-						distf[other] = newdist;
-						prev[other] = nodef;
-					}
-				}
-			}
+u32 Graph::dist_road(Graph_position const s_ext, Graph_position const t_ext, Buffer* into,
+		Search_stats* stats, Search_workspace* workspace) const {
+	Graph_position const s = to_internal(s_ext);
+	Graph_position const t = to_internal(t_ext);
+
+	u32 trivial = dist_trivial(*this, s, t);
+	if (trivial != dist_invalid) {
+		if (into) {
+			int route_ofs = into->size();
+			into->emplace_back<Route_t>();
+			into->get<Route_t>(route_ofs).init(into);
+			if (s.is_node()) into->get<Route_t>(route_ofs).push_back(s_ext.id, into);
 		}
-		ringf.erase(elf);
-
-		if (ringb.empty()) break;
-		auto elb = ringb.begin();
-		if (elb->first >= inc) break;
-		auto nodeb = elb->second;
-		// bidirectional paths meet
-		if (getvf(nodeb)) {
-			assert(distf[nodeb] != dist_invalid);
-			auto d = distf[nodeb] + distb[nodeb];
-			if (d < inc) {
-				// update incumbent
-				midnode = nodeb;
-				inc = d;
-				if (s.is_node() and (u32)s.id == nodeb) break;
-			}
-		} else {
-			setvb(nodeb);
-			auto const& rangeb = nodes()[nodeb].iter(*this);
-			for (auto it = rangeb.begin(); it != rangeb.end(); ++it) {
-				// skip misaligned one-way streets
-				u32 flags = edges()[it.edge].flags;
-				if (it.is_nodea and (flags & 2) == 0) continue;
-				if (!it.is_nodea and (flags & 1) == 0) continue;
-
-				auto other = it.is_nodea ? it->nodeb : it->nodea;
-				assert(other != node_invalid);
-				auto newdist = distb[nodeb] + it->dist;
-                if (newdist <= estimatef(other)) {
-                    JDBG_L < "Misestimation:" < newdist < estimatef(other) ,0;
-                }
-
-				if (newdist < distb[other]) {
-					auto e = estimateb(other);
-					// check against upper bound
-					if (newdist + e < inc) {
-						if(distb[other] == dist_invalid) ringb.insert({ newdist + e, other });
-						distb[other] = newdist;
-						next[other] = nodeb;
-					}
-				}
-			}
+		return trivial;
+	}
+
+	static thread_local Search_workspace thread_workspace;
+	auto& ws = workspace ? *workspace : thread_workspace;
+	ws.reset(nodes().size());
+
+	// the searches start at the ends of the chains of s and t
+	auto& reach_s = ws.reach_s;
+	auto& reach_t = ws.reach_t;
+	chain_reach(*this, s, false, &reach_s);
+	chain_reach(*this, t, true,  &reach_t);
+	if (stats) stats->edges += s.is_edge() + t.is_edge();
+
+	// length of the best path, its middle node or the node where it meets on a common chain
+	u32 midnode = node_invalid;
+	int mid_chain = -1;
+	u32 inc = chain_direct(reach_s, reach_t, &mid_chain);
+
+	// Lower bounds of the distance from a node to t, and from s to a node, using the landmarks.
+	// They only depend on where the chains of s and t can be left and entered.
+	auto bound_to_t = [this, &reach_t](u32 node) {
+		u32 result = dist_invalid;
+		for (int end: { 0, (int)reach_t.nodes.size() - 1 }) {
+			if (reach_t.dist[end] == dist_invalid) continue;
+			result = std::min(result, landmark_bound(node, reach_t.nodes[end]) + reach_t.dist[end]);
+		}
+		return result == dist_invalid ? 0 : result;
+	};
+	auto bound_from_s = [this, &reach_s](u32 node) {
+		u32 result = dist_invalid;
+		for (int end: { 0, (int)reach_s.nodes.size() - 1 }) {
+			if (reach_s.dist[end] == dist_invalid) continue;
+			result = std::min(result, reach_s.dist[end] + landmark_bound(reach_s.nodes[end], node));
 		}
-		ringb.erase(elb);
+		return result == dist_invalid ? 0 : result;
+	};
+
+	// bidirectional A* going upwards in the hierarchy, the nodes are queued by their distance plus
+	// the bound towards the other side. The direction is selected by the members of the entries it
+	// uses.
+	using Entry = Search_workspace::Entry;
+	auto relax = [&ws](Dist_heap& ring, u32 Entry::* dist, u32 node, u32 d, auto const& bound) {
+		auto& e = ws[node];
+		if (d >= e.*dist) return false;
+		ring.push(node, (e.*dist = d) + bound(node));
+		return true;
+	};
+	for (int end: { 0, (int)reach_s.nodes.size() - 1 }) {
+		if (reach_s.dist[end] == dist_invalid) continue;
+		relax(ws.heapf, &Entry::distf, reach_s.nodes[end], reach_s.dist[end], bound_to_t);
+	}
+	for (int end: { 0, (int)reach_t.nodes.size() - 1 }) {
+		if (reach_t.dist[end] == dist_invalid) continue;
+		relax(ws.heapb, &Entry::distb, reach_t.nodes[end], reach_t.dist[end], bound_from_s);
+	}
+
+	auto step = [&](Dist_heap& ring, u32 Entry::* dist, u32 Entry::* dist_other, u32 Entry::* prev,
+			bool reverse, auto const& bound) {
+		u32 node = ring.pop().node;
+		auto const& e = ws[node];
+		u32 d = e.*dist;
+		if (e.*dist_other != dist_invalid and d + e.*dist_other < inc) {
+			inc = d + e.*dist_other;
+			midnode = node;
+			mid_chain = -1;
+		}
+		auto arcs = reverse ? ch_arcs_down(node) : ch_arcs_up(node);
+		if (stats) {
+			++stats->settled;
+			stats->arcs += arcs.size();
+		}
+		for (auto const& arc: arcs) {
+			if (relax(ring, dist, arc.node, d + arc.dist, bound)) ws[arc.node].*prev = arc.edge;
+		}
+	};
+	// the bounds are consistent, so a direction can stop once no queued node can improve inc
+	while (true) {
+		bool goonf = not ws.heapf.empty() and ws.heapf.top().dist < inc;
+		bool goonb = not ws.heapb.empty() and ws.heapb.top().dist < inc;
+		if (not goonf and not goonb) break;
+		if (goonf) step(ws.heapf, &Entry::distf, &Entry::distb, &Entry::prev, false, bound_to_t);
+		if (goonb) step(ws.heapb, &Entry::distb, &Entry::distf, &Entry::next, true, bound_from_s);
 	}
 
 	if (inc == dist_invalid) {
-		jerr << "No path found in A*" << endl;
+		jerr << "No path found in dist_road" << endl;
 		jout << (u16)s.edge_pos << ", " << s.id << ", " << (u16)t.edge_pos << ", " << t.id << endl;
-		auto a = get_pos_back(s.is_edge() ? nodes()[edges()[s.id].nodea].pos : nodes()[s.id].pos),
-			b = get_pos_back(t.is_edge() ? nodes()[edges()[t.id].nodea].pos : nodes()[t.id].pos);
+		auto a = get_pos_back(s.is_edge() ? nodes()[edges_hot()[s.id].nodea].pos : nodes()[s.id].pos),
+			b = get_pos_back(t.is_edge() ? nodes()[edges_hot()[t.id].nodea].pos : nodes()[t.id].pos);
 		jout << a.first << ", " << a.second << ", " << b.first << ", " << b.second << endl;
-		if (s.is_edge() and (edges()[s.id].flags & 3) < 3) {
-			auto const& edge = edges()[s.id];
-			if (edge.flags & 1) jout << edge.linkb << ", " << nodes()[edge.nodeb].edge << endl;
-			if (edge.flags & 2) jout << edge.linka << ", " << nodes()[edge.nodea].edge << endl;
-		}
-		if (t.is_edge() and (edges()[t.id].flags & 3) < 3) {
-			auto const& edge = edges()[t.id];
-			if (edge.flags & 1) jout << edge.linkb << ", " << nodes()[edge.nodeb].edge << endl;
-			if (edge.flags & 2) jout << edge.linka << ", " << nodes()[edge.nodea].edge << endl;
-		}
 		assert(false);
 		return inc;
 	}
@@ -445,128 +749,294 @@ u32 Graph::dist_road(Graph_position const s, Graph_position const t, Buffer* int
 	if (into) {
 		auto ofs = into->size();
 		into->emplace_back<Route_t>().init(into);
-		// write route from (excluded) midnode to begin
-		for (auto cur = prev[midnode]; cur != node_invalid; cur = prev[cur]) {
-			into->get<Route_t>(ofs).push_back(cur, into);
-		}
-		auto& route = into->get<Route_t>(ofs);
-		auto size = route.size();
-		// reverse route
-		for (Route_t::Size_t i = 0; 2 * i < size - 1; ++i) {
-			Route_t::Size_t o = size - i - 1;
-			auto tmp = route[i];
-			route[i] = route[o];
-			route[o] = tmp;
-		}
-		// write route from midnode to end
-		for (auto cur = midnode; cur != node_invalid; cur = next[cur]) {
-			into->get<Route_t>(ofs).push_back(cur, into);
+		auto push = [this, into, ofs](u32 node) {
+			into->get<Route_t>(ofs).push_back(node_external(node), into);
+		};
+		auto const& ns = reach_s.nodes;
+		auto const& nt = reach_t.nodes;
+		if (mid_chain != -1) {
+			// the path stays on the chain
+			if (reach_s.ib <= reach_t.ia) {
+				for (int i = reach_s.ib; i <= reach_t.ia; ++i) push(ns[i]);
+			} else {
+				for (int i = reach_s.ia; i >= reach_t.ib; --i) push(ns[i]);
+			}
+		} else {
+			// the arcs from s to midnode, in order
+			std::vector<u32> arcs;
+			u32 cur = midnode;
+			for (; ws[cur].prev != node_invalid; cur = ch_other(*this, ws[cur].prev, cur)) {
+				arcs.push_back(ws[cur].prev);
+			}
+			std::reverse(arcs.begin(), arcs.end());
+
+			// from s to the end of its chain, then up and down the hierarchy
+			if (cur == ns.front() and reach_s.dist.front() == ws[cur].distf) {
+				for (int i = reach_s.ia; i >= 0; --i) push(ns[i]);
+			} else {
+				for (int i = reach_s.ib; i < (int)ns.size(); ++i) push(ns[i]);
+			}
+			for (u32 arc: arcs) {
+				ch_unpack(*this, arc, cur, push);
+				cur = ch_other(*this, arc, cur);
+			}
+			assert(cur == midnode);
+			for (; ws[cur].next != node_invalid; cur = ch_other(*this, ws[cur].next, cur)) {
+				ch_unpack(*this, ws[cur].next, cur, push);
+			}
+
+			// from the end of the chain of t to t
+			if (cur == nt.front() and reach_t.dist.front() == ws[cur].distb) {
+				for (int i = 1; i <= reach_t.ia; ++i) push(nt[i]);
+			} else {
+				for (int i = nt.size() - 2; i >= reach_t.ib; --i) push(nt[i]);
+			}
 		}
 	}
 	return inc;
 }
 
-void Dist_cache::add_lookup(Graph_position pos) {
-	assert(pos.id != node_invalid);
-	lookup_buffer.reserve_space(sizeof(Lookups_t::Type));
-	auto& ls = lookup_buffer.get<Lookups_t>();
-	u32 l = ls.size();
-	ls.push_back({ pos, l }, &lookup_buffer);
-	std::sort(ls.begin(), ls.end());
+void Graph::dist_table(Array_view<Graph_position> sources, Array_view<Graph_position> targets,
+		u32* out, Search_workspace* workspace) const {
+	static thread_local Search_workspace thread_workspace;
+	auto& ws = workspace ? *workspace : thread_workspace;
+	int nt = targets.size();
 
-	auto nnodes = graph->nodes().size();
-	lookup_data.addsize(4 * nnodes * sizeof(u32));
+	// the nodes reached by the search of each target, with the distance to it
+	struct Bucket {
+		u32 node, target, dist;
+		bool operator< (Bucket o) const { return node < o.node; }
+	};
+	std::vector<Bucket> buckets;
+	std::vector<Chain_reach> reach_t (nt);
+	for (int j = 0; j < nt; ++j) {
+		chain_reach(*this, to_internal(targets[j]), true, &reach_t[j]);
+		ch_search(*this, &ws, reach_t[j], true, [&buckets, j](u32 node, u32 dist) {
+			buckets.push_back({ node, (u32)j, dist });
+		});
+	}
+	std::sort(buckets.begin(), buckets.end());
+
+	// the search of each source meets those of the targets in the buckets
+	for (int i = 0; i < sources.size(); ++i) {
+		u32* row = out + i * nt;
+		std::fill(row, row + nt, dist_invalid);
+		Graph_position s = to_internal(sources[i]);
+		chain_reach(*this, s, false, &ws.reach_s);
+		ch_search(*this, &ws, ws.reach_s, false, [&buckets, row](u32 node, u32 dist) {
+			auto range = std::equal_range(buckets.begin(), buckets.end(), Bucket { node, 0, 0 });
+			for (auto it = range.first; it != range.second; ++it) {
+				row[it->target] = std::min(row[it->target], dist + it->dist);
+			}
+		});
+
+		for (int j = 0; j < nt; ++j) {
+			u32 trivial = dist_trivial(*this, s, to_internal(targets[j]));
+			if (trivial != dist_invalid) {
+				row[j] = trivial;
+			} else {
+				int mid_chain;
+				row[j] = std::min(row[j], chain_direct(ws.reach_s, reach_t[j], &mid_chain));
+			}
+		}
+	}
+}
+
+u32 Graph::hub_dist(u32 a, u32 b) const {
+	auto la = hubs_out(a);
+	auto lb = hubs_in(b);
+	u32 result = dist_invalid;
+	for (int i = 0, j = 0; i < la.size() and j < lb.size();) {
+		if (la[i].node < lb[j].node) {
+			++i;
+		} else if (la[i].node > lb[j].node) {
+			++j;
+		} else {
+			result = std::min(result, la[i].dist + lb[j].dist);
+			++i;
+			++j;
+		}
+	}
+	return result;
+}
 
-	// forward dijkstra
-	u32* dist = (u32*)lookup_data.end() - 4 * nnodes;
-	u32* prev = (u32*)lookup_data.end() - 3 * nnodes;
+u32 Graph::dist_labels(Graph_position const s_ext, Graph_position const t_ext,
+		Search_workspace* workspace) const {
+	if (not has_hub_labels()) return dist_road(s_ext, t_ext, nullptr, nullptr, workspace);
+	Graph_position const s = to_internal(s_ext);
+	Graph_position const t = to_internal(t_ext);
+
+	u32 trivial = dist_trivial(*this, s, t);
+	if (trivial != dist_invalid) return trivial;
+
+	static thread_local Search_workspace thread_workspace;
+	auto& ws = workspace ? *workspace : thread_workspace;
+	auto& reach_s = ws.reach_s;
+	auto& reach_t = ws.reach_t;
+	chain_reach(*this, s, false, &reach_s);
+	chain_reach(*this, t, true,  &reach_t);
+
+	// either the path stays on the chain, or it leaves the chain of s and enters the one of t at
+	// one of their ends
+	int mid_chain;
+	u32 result = chain_direct(reach_s, reach_t, &mid_chain);
+	for (int end_s: { 0, (int)reach_s.nodes.size() - 1 }) {
+		if (reach_s.dist[end_s] == dist_invalid) continue;
+		for (int end_t: { 0, (int)reach_t.nodes.size() - 1 }) {
+			if (reach_t.dist[end_t] == dist_invalid) continue;
+			u32 d = hub_dist(reach_s.nodes[end_s], reach_t.nodes[end_t]);
+			if (d == dist_invalid) continue;
+			result = std::min(result, reach_s.dist[end_s] + d + reach_t.dist[end_t]);
+		}
+	}
+	return result;
+}
+
+/**
+ * Run a complete dijkstra from the internal positions in sources, backwards if backward, and write
+ * the distance of each node from (to) the nearest source into dist. prev gets the previous (next)
+ * node, see Graph::chain_fill.
+ */
+static void sweep(Graph const& g, Array_view<Graph_position> sources, bool backward,
+		Dist_heap* heap, u32* dist, u32* prev) {
+	auto nnodes = g.nodes().size();
 	for (auto i = std::numeric_limits<u32>::min(); i < nnodes; ++i) {
 		dist[i] = std::numeric_limits<u32>::max();
 		prev[i] = edge_invalid;
 	}
-	auto ring = std::set<std::pair<u32, u32>>();
+	auto& ring = *heap;
+	ring.reset(nnodes);
+	auto seed = [&ring, dist](u32 node, u32 d) {
+		if (d < dist[node]) ring.push(node, dist[node] = d);
+	};
 
-	if (pos.is_edge()) {
-		auto const& es = graph->edges()[pos.id];
-		assert(es.nodea != node_invalid and es.nodeb != node_invalid);
-		if (es.flags & 2)
-			ring.insert({ (dist[es.nodea] = (u32)(pos.get_edge_pos() * es.dist)), es.nodea });
-		if (es.flags & 1)
-			ring.insert({ (dist[es.nodeb] = (u32)((1.f - pos.get_edge_pos()) * es.dist)), es.nodeb });
-	} else {
-		dist[pos.id] = 0;
-		ring.insert({ 0, pos.id });
+	// Forwards, the position reaches nodea if the edge may be used from nodeb to nodea (flag 2).
+	// Backwards, nodea has to reach the position, which needs the other direction.
+	u32 flags_a = backward ? 1 : 2, flags_b = backward ? 2 : 1;
+	for (auto pos: sources) {
+		if (pos.is_edge()) {
+			auto const& es = g.edges_hot()[pos.id];
+			assert(es.nodea != node_invalid and es.nodeb != node_invalid);
+			if (es.flags & flags_a) seed(es.nodea, (u32)(pos.get_edge_pos() * es.dist));
+			if (es.flags & flags_b) seed(es.nodeb, (u32)((1.f - pos.get_edge_pos()) * es.dist));
+		} else {
+			seed(pos.id, 0);
+		}
 	}
 
-	for (auto el = ring.begin(); el != ring.end(); el = ring.begin()) {
-		auto node = el->second;
-		auto const& range = graph->nodes()[node].iter(*graph);
-		for (auto it = range.begin(); it != range.end(); ++it) {
-			u32 flags = it->flags;
-
-			if (it.is_nodea and (flags & 1) == 0) continue;
-			if (!it.is_nodea and (flags & 2) == 0) continue;
-
-			auto other = it.is_nodea ? it->nodeb : it->nodea;
+	while (not ring.empty()) {
+		auto el = ring.pop();
+		auto node = el.node;
+		bool chained = g.in_overlay(node);
+		for (auto const& arc: backward ? g.search_arcs_in(node) : g.search_arcs_out(node)) {
+			auto other = arc.node;
 			assert(other != node_invalid);
-			auto newdist = el->first + it->dist;
+			auto newdist = el.dist + arc.dist;
 
 			if (dist[other] > newdist) {
 				// update distance
-				if (dist[other] < std::numeric_limits<u32>::max()) ring.erase({ dist[other], other });
-				ring.insert({ newdist, other });
+				ring.push(other, newdist);
 				dist[other] = newdist;
-				prev[other] = node;
+				prev[other] = chained ? arc.edge | prev_chain : node;
 			}
 		}
-		ring.erase(el);
-
 	}
+	g.chain_fill(dist, prev, backward);
+}
 
-	// backward dijkstra
-	dist = (u32*)lookup_data.end() - 2 * nnodes;
-	u32* next = (u32*)lookup_data.end() - 1 * nnodes;
-	for (auto i = std::numeric_limits<u32>::min(); i < nnodes; ++i) {
-		dist[i] = std::numeric_limits<u32>::max();
-		next[i] = edge_invalid;
+void Dist_cache::calc_charging(Array_view<u8> station_ids) {
+	std::vector<Graph_position> stations;
+	for (u8 id: station_ids) {
+		assert(id_to_index1[id] < facility_count);
+		stations.push_back(graph->to_internal(positions[id_to_index1[id]]));
 	}
-
-	if (pos.is_edge()) {
-		auto const& edge = graph->edges()[pos.id];
-		assert(edge.nodea != node_invalid and edge.nodeb != node_invalid);
-		if (edge.flags & 1)
-			ring.insert({ (dist[edge.nodea] = (u32)(pos.get_edge_pos() * edge.dist)), edge.nodea });
-		if (edge.flags & 2)
-			ring.insert({ (dist[edge.nodeb] = (u32)((1.f - pos.get_edge_pos()) * edge.dist)), edge.nodeb });
-	} else {
-		ring.insert({ dist[pos.id] = 0, pos.id });
+	auto nnodes = graph->nodes().size();
+	charging_dist.resize(nnodes);
+	std::vector<u32> next (nnodes);
+	sweep(*graph, {stations.data(), (int)stations.size()}, true, &workspace.heapf,
+		charging_dist.data(), next.data());
+
+	// From a facility on an edge, the station may also be further along the same edge. The
+	// distances are rounded down to km like those of the matrix, which keeps their minimum the same.
+	facility_charging.resize(facility_count);
+	for (int f = 0; f < facility_count; ++f) {
+		auto pos = graph->to_internal(positions[f]);
+		u32 dist = dist_invalid;
+		if (pos.is_node()) {
+			dist = charging_dist[pos.id];
+		} else {
+			auto const& edge = graph->edges_hot()[pos.id];
+			if (edge.flags & 2 and charging_dist[edge.nodea] != dist_invalid) {
+				dist = std::min(dist, charging_dist[edge.nodea] + (u32)(pos.get_edge_pos() * edge.dist));
+			}
+			if (edge.flags & 1 and charging_dist[edge.nodeb] != dist_invalid) {
+				dist = std::min(dist, charging_dist[edge.nodeb] + (u32)((1.f - pos.get_edge_pos()) * edge.dist));
+			}
+		}
+		for (auto station: stations) dist = std::min(dist, dist_trivial(*graph, pos, station));
+		facility_charging[f] = to_km(dist);
 	}
+}
 
-	for (auto el = ring.begin(); el != ring.end(); el = ring.begin()) {
-		auto node = el->second;
-		auto const& range = graph->nodes()[node].iter(*graph);
-		for (auto it = range.begin(); it != range.end(); ++it) {
-			auto other = it.is_nodea ? it->nodeb : it->nodea;
-			auto newdist = el->first + it->dist;
-			u32 flags = it->flags;
+u32 Dist_cache::register_lookup(Graph_position pos_ext) {
+	assert(pos_ext.id != node_invalid);
+	lookup_buffer.reserve_space(sizeof(Lookups_t::Type));
+	auto& ls = lookup_buffer.get<Lookups_t>();
+	u32 l = ls.size();
+	ls.push_back({ pos_ext, l }, &lookup_buffer);
+	std::sort(ls.begin(), ls.end());
+	return l;
+}
 
-			if (it.is_nodea and (flags & 2) == 0) continue;
-			if (!it.is_nodea and (flags & 1) == 0) continue;
+void Dist_cache::add_lookup(Graph_position pos_ext, Search_workspace* workspace_) {
+	join_lookups();
+	u32 l = register_lookup(pos_ext);
+	lookup_data.addsize(lookup_size());
+	lookup_shifts.resize(2 * (l + 1));
+
+	// the tables have to be filled completely anyway, only the queue comes from the workspace
+	auto& ring = (workspace_ ? workspace_ : &workspace)->heapf;
+	// the tables are indexed by the internal ids
+	Graph_position pos = graph->to_internal(pos_ext);
+	sweep_lookup(l, pos, false, &ring, &lookup_scratch);
+	sweep_lookup(l, pos, true, &ring, &lookup_scratch);
+}
 
-			if (dist[other] > newdist) {
-				// update distance
-				if (dist[other] < std::numeric_limits<u32>::max()) ring.erase({ dist[other], other });
-				ring.insert({ newdist, other });
-				dist[other] = newdist;
-				next[other] = node;
-			}
-		}
-		ring.erase(el);
+void Dist_cache::sweep_lookup(u32 l, Graph_position pos, bool backward, Dist_heap* heap,
+		std::vector<u32>* scratch) {
+	auto nnodes = graph->nodes().size();
+	u32* dist;
+	if (lookup_routes) {
+		dist = (u32*)lookup_data.data() + (4 * l + (backward ? 2 : 0)) * nnodes;
+	} else {
+		scratch->resize(2 * nnodes);
+		dist = scratch->data();
+	}
+	u32* prev = dist + nnodes;
+	sweep(*graph, {&pos, 1}, backward, heap, dist, prev);
+	if (lookup_routes) return;
 
+	// the smallest unit that fits all distances, 0xffff means unreachable
+	u32 max = 0;
+	for (u32 i = 0; i < nnodes; ++i) {
+		if (dist[i] != dist_invalid) max = std::max(max, dist[i]);
+	}
+	u8 shift = 0;
+	while ((max >> shift) >= 0xffff) ++shift;
+	lookup_shifts[2 * l + backward] = shift;
+	u16* table = (u16*)lookup_data.data() + (2 * l + backward) * nnodes;
+	for (u32 i = 0; i < nnodes; ++i) {
+		table[i] = dist[i] == dist_invalid ? 0xffff : (u16)(dist[i] >> shift);
 	}
 }
 
+void Dist_cache::join_lookups() {
+	for (auto& i: lookup_workers) i.join();
+	lookup_workers.clear();
+}
+
 u32 Dist_cache::get_lookup(Graph_position pos) const {
+	if (not lookups_ready.load(std::memory_order_acquire)) return lookup_invalid;
 	auto const& ls = lookup_buffer.get<Lookups_t>();
 	// binary search
 	s32 l = 0, r = ls.size() - 1;
@@ -584,283 +1054,1495 @@ u32 Dist_cache::get_lookup(Graph_position pos) const {
 }
 
 
-void Graph::init(Buffer_view name, Buffer_view node_filename, Buffer_view edge_filename, Buffer_view geometry_filename) {
+/**
+ * Run Tarjan's strongly connected components algorithm on the graph with n nodes given in adjacency
+ * array form: the arcs leaving node i are adj[adj_begin[i]] to adj[adj_begin[i+1] - 1]. Writes the
+ * component of each node into comp and returns the component containing the most nodes.
+ */
+static u32 largest_scc(u32 n, u32 const* adj_begin, Arc const* adj, u32* comp) {
+	auto index = std::make_unique<u32[]>(n);
+	auto lowlink = std::make_unique<u32[]>(n);
+	auto on_stack = std::make_unique<bool[]>(n);
+	auto stack = std::make_unique<u32[]>(n);
+	// the recursion, each level stores its node and the next adjacency entry to look at
+	auto call_node = std::make_unique<u32[]>(n);
+	auto call_it = std::make_unique<u32[]>(n);
+	for (u32 i = 0; i < n; ++i) {
+		index[i] = node_invalid;
+		on_stack[i] = false;
+	}
+
+	u32 current_index = 0, stack_size = 0, comp_count = 0;
+	u32 best = 0, best_size = 0;
+	for (u32 root = 0; root < n; ++root) {
+		if (index[root] != node_invalid) continue;
+		u32 depth = 0;
+		call_node[0] = root;
+		call_it[0] = adj_begin[root];
+		index[root] = lowlink[root] = current_index++;
+		stack[stack_size++] = root;
+		on_stack[root] = true;
+
+		while (true) {
+			u32 node = call_node[depth];
+			if (call_it[depth] < adj_begin[node + 1]) {
+				u32 other = adj[call_it[depth]++].node;
+				if (index[other] == node_invalid) {
+					index[other] = lowlink[other] = current_index++;
+					stack[stack_size++] = other;
+					on_stack[other] = true;
+					++depth;
+					call_node[depth] = other;
+					call_it[depth] = adj_begin[other];
+				} else if (on_stack[other] and index[other] < lowlink[node]) {
+					lowlink[node] = index[other];
+				}
+				continue;
+			}
+
+			if (lowlink[node] == index[node]) {
+				u32 size = 0;
+				u32 c = node_invalid;
+				while (c != node) {
+					assert(stack_size > 0);
+					c = stack[--stack_size];
+					on_stack[c] = false;
+					comp[c] = comp_count;
+					++size;
+				}
+				if (size > best_size) {
+					best = comp_count;
+					best_size = size;
+				}
+				++comp_count;
+			}
+			if (depth == 0) break;
+			--depth;
+			u32 parent = call_node[depth];
+			if (lowlink[node] < lowlink[parent]) lowlink[parent] = lowlink[node];
+		}
+	}
+	return best;
+}
+
+/**
+ * Append the adjacency arrays of the nodes to data and return the offsets of the index and of the
+ * arcs. for_arcs(node, fn) has to call fn with each arc of the node, in the same order every time.
+ */
+template <typename Fn>
+static std::pair<int, int> append_arcs(Buffer* data, u32 nnodes, Fn const& for_arcs) {
+	// the index has an additional entry at the end, holding the total number of arcs
+	int index_offset = data->size();
+	data->emplace_back<Graph::Arc_index_t>().init(nnodes + 1, data);
+	u32 count = 0;
+	for (u32 i = 0; i < nnodes; ++i) {
+		data->get<Graph::Arc_index_t>(index_offset)[i] = count;
+		for_arcs(i, [&count](Arc) { ++count; });
+	}
+	data->get<Graph::Arc_index_t>(index_offset)[nnodes] = count;
+
+	int arcs_offset = data->size();
+	auto g = data->reserve_guard(Graph::Arcs_t::total_space(count));
+	auto& arcs = data->emplace_back<Graph::Arcs_t>();
+	arcs.init(data);
+	data->addsize(count * sizeof(Arc));
+	arcs.m_size() = count;
+
+	u32 j = 0;
+	for (u32 i = 0; i < nnodes; ++i) {
+		for_arcs(i, [&arcs, &j](Arc arc) { arcs[j++] = arc; });
+	}
+	assert(j == count);
+	return {index_offset, arcs_offset};
+}
+
+void Graph::crop(Graph_options const& crop_options) {
+	assert(crop_options.crop and not m_mapped);
+	// Padding added on every side of the box, relative to its size
+	constexpr double crop_padding = 0.1;
+
+	double lat_pad = (crop_options.crop_max_lat - crop_options.crop_min_lat) * crop_padding;
+	double lon_pad = (crop_options.crop_max_lon - crop_options.crop_min_lon) * crop_padding;
+	double min_lat = crop_options.crop_min_lat - lat_pad;
+	double max_lat = crop_options.crop_max_lat + lat_pad;
+	double min_lon = crop_options.crop_min_lon - lon_pad;
+	double max_lon = crop_options.crop_max_lon + lon_pad;
+
+	u32 nnodes = nodes().size();
+	u32 nedges = edges_hot().size();
+	auto inside = std::make_unique<bool[]>(nnodes);
+	for (u32 i = 0; i < nnodes; ++i) {
+		auto const& node = nodes()[i];
+		auto p = get_pos_back(node.pos);
+		inside[i] = node.edge != edge_invalid and min_lat <= p.first and p.first <= max_lat
+			and min_lon <= p.second and p.second <= max_lon;
+	}
+	auto usable = [this, &inside](u32 edge) {
+		auto const& e = edges_hot()[edge];
+		return e.nodea != node_invalid and e.nodeb != node_invalid and e.nodea != e.nodeb
+			and inside[e.nodea] and inside[e.nodeb];
+	};
+
+	// the arcs of the part inside the box
+	auto adj_begin = std::make_unique<u32[]>(nnodes + 1);
+	auto adj = std::make_unique<Arc[]>(get<Arcs_t>(arc_out_offset).size());
+	u32 adj_size = 0;
+	for (u32 i = 0; i < nnodes; ++i) {
+		adj_begin[i] = adj_size;
+		if (not inside[i]) continue;
+		for (auto const& arc: arcs_out(i)) {
+			if (usable(arc.edge)) adj[adj_size++] = arc;
+		}
+	}
+	adj_begin[nnodes] = adj_size;
+	auto comp = std::make_unique<u32[]>(nnodes);
+	u32 main_comp = largest_scc(nnodes, adj_begin.get(), adj.get(), comp.get());
+
+	// renumber the remaining nodes and edges, keeping their order
+	auto new_id = std::make_unique<u32[]>(nnodes);
+	u32 new_nnodes = 0;
+	for (u32 i = 0; i < nnodes; ++i) {
+		new_id[i] = inside[i] and comp[i] == main_comp ? new_nnodes++ : node_invalid;
+	}
+	assert(new_nnodes > 1);
+
+	auto new_edge = std::make_unique<u32[]>(nedges);
+	u32 new_nedges = 0;
+	for (u32 i = 0; i < nedges; ++i) {
+		auto const& e = edges_hot()[i];
+		bool keep = usable(i) and new_id[e.nodea] != node_invalid and new_id[e.nodeb] != node_invalid;
+		new_edge[i] = keep ? new_nedges++ : edge_invalid;
+	}
+	renumber(new_id.get(), new_nnodes, new_edge.get(), new_nedges);
+}
+
+void Graph::renumber(u32 const* new_id, u32 new_nnodes, u32 const* new_edge, u32 new_nedges) {
+	assert(not m_mapped);
+	u32 nnodes = nodes().size();
+	u32 nedges = edges_hot().size();
+
+	auto old_id = std::make_unique<u32[]>(new_nnodes);
+	for (u32 i = 0; i < nnodes; ++i) {
+		if (new_id[i] != node_invalid) old_id[new_id[i]] = i;
+	}
+	auto old_edge = std::make_unique<u32[]>(new_nedges);
+	int geometry_space = Geometry_t::total_space(0);
+	for (u32 i = 0; i < nedges; ++i) {
+		if (new_edge[i] == edge_invalid) continue;
+		auto const& e = edges_hot()[i];
+		assert(new_id[e.nodea] != node_invalid and new_id[e.nodeb] != node_invalid);
+		old_edge[new_edge[i]] = i;
+		geometry_space += geometry(i).size();
+	}
+
+	Buffer data;
+	int new_name_offset, new_node_offset, new_edge_hot_offset, new_edge_cold_offset;
+	int new_geometry_offset;
+	{
+		auto g = data.reserve_guard(name_size + 1 + Nodes_t::total_space(new_nnodes)
+			+ Edges_hot_t::total_space(new_nedges) + Edges_cold_t::total_space(new_nedges)
+			+ geometry_space);
+
+		new_name_offset = data.size();
+		data.append(name());
+		data.append("", 1);
+
+		new_node_offset = data.size();
+		auto& new_nodes = data.emplace_back<Nodes_t>();
+		new_nodes.init(&data);
+		data.addsize(new_nnodes * sizeof(Node));
+		new_nodes.m_size() = new_nnodes;
+		for (u32 i = 0; i < new_nnodes; ++i) {
+			new_nodes[i] = { edge_invalid, nodes()[old_id[i]].pos };
+		}
+
+		new_edge_hot_offset = data.size();
+		auto& hot = data.emplace_back<Edges_hot_t>();
+		hot.init(&data);
+		data.addsize(new_nedges * sizeof(Edge_hot));
+		hot.m_size() = new_nedges;
+
+		new_edge_cold_offset = data.size();
+		auto& cold = data.emplace_back<Edges_cold_t>();
+		cold.init(&data);
+		data.addsize(new_nedges * sizeof(Edge_cold));
+		cold.m_size() = new_nedges;
+
+		// the geometry is relative to nodea, which stays the same
+		new_geometry_offset = data.size();
+		data.emplace_back<Geometry_t>().init(&data);
+		int geometry_begin = data.size();
+		for (u32 j = 0; j < new_nedges; ++j) {
+			u32 i = old_edge[j];
+			auto const& e = edges_hot()[i];
+			hot[j] = { new_id[e.nodea], new_id[e.nodeb], e.dist, e.flags };
+			cold[j] = { (u32)(data.size() - geometry_begin), edges_cold()[i].name };
+			data.append(geometry(i));
+			for (u32 node: { hot[j].nodea, hot[j].nodeb }) {
+				if (new_nodes[node].edge == edge_invalid) new_nodes[node].edge = j;
+			}
+		}
+		data.get<Geometry_t>(new_geometry_offset).m_size() = data.size() - geometry_begin;
+	}
+
+	// the arcs that are left, in the same order
+	auto kept_arcs = [&](bool reverse) {
+		return [&, reverse](u32 node, auto&& fn) {
+			for (auto arc: reverse ? arcs_in(old_id[node]) : arcs_out(old_id[node])) {
+				if (new_edge[arc.edge] == edge_invalid) continue;
+				arc.node = new_id[arc.node];
+				arc.edge = new_edge[arc.edge];
+				fn(arc);
+			}
+		};
+	};
+	auto arcs_out_offsets = append_arcs(&data, new_nnodes, kept_arcs(false));
+	auto arcs_in_offsets  = append_arcs(&data, new_nnodes, kept_arcs(true));
+
+	m_data = std::move(data);
+	name_offset = new_name_offset;
+	node_offset = new_node_offset;
+	edge_hot_offset = new_edge_hot_offset;
+	edge_cold_offset = new_edge_cold_offset;
+	geometry_offset = new_geometry_offset;
+	std::tie(arc_out_index_offset, arc_out_offset) = arcs_out_offsets;
+	std::tie(arc_in_index_offset,  arc_in_offset ) = arcs_in_offsets;
+}
+
+/**
+ * Return the index of the point on the Hilbert curve filling the 2^16 x 2^16 square.
+ */
+static u64 hilbert_index(u32 x, u32 y) {
+	u64 d = 0;
+	for (u32 s = 1 << 15; s > 0; s >>= 1) {
+		u32 rx = (x & s) > 0;
+		u32 ry = (y & s) > 0;
+		d += (u64)s * s * ((3 * rx) ^ ry);
+		// rotate the quadrant
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - (x & (s - 1));
+				y = s - 1 - (y & (s - 1));
+			}
+			std::swap(x, y);
+		}
+		x &= s - 1;
+		y &= s - 1;
+	}
+	return d;
+}
+
+void Graph::reorder(u8 order) {
+	assert(not m_mapped and node_internal_offset == -1);
+	u32 nnodes = nodes().size();
+	u32 nedges = edges_hot().size();
+
+	// the nodes in their new order, removed nodes are dropped
+	std::vector<u32> order_nodes;
+	order_nodes.reserve(nnodes);
+	if (order == Graph_options::REORDER_HILBERT) {
+		std::vector<std::pair<u64, u32>> keys;
+		keys.reserve(nnodes);
+		for (u32 i = 0; i < nnodes; ++i) {
+			auto const& node = nodes()[i];
+			if (node.edge == edge_invalid) continue;
+			keys.push_back({ hilbert_index(node.pos.lat, node.pos.lon), i });
+		}
+		std::sort(keys.begin(), keys.end());
+		for (auto i: keys) order_nodes.push_back(i.second);
+	} else if (order == Graph_options::REORDER_BFS) {
+		// breadth-first search ignoring the direction of the arcs
+		auto seen = std::make_unique<bool[]>(nnodes);
+		for (u32 i = 0; i < nnodes; ++i) seen[i] = nodes()[i].edge == edge_invalid;
+		for (u32 root = 0; root < nnodes; ++root) {
+			if (seen[root]) continue;
+			seen[root] = true;
+			u32 next = order_nodes.size();
+			order_nodes.push_back(root);
+			for (; next < order_nodes.size(); ++next) {
+				u32 node = order_nodes[next];
+				for (auto arcs: { arcs_out(node), arcs_in(node) }) {
+					for (auto const& arc: arcs) {
+						if (seen[arc.node]) continue;
+						seen[arc.node] = true;
+						order_nodes.push_back(arc.node);
+					}
+				}
+			}
+		}
+	} else {
+		assert(false);
+	}
+
+	auto new_id = std::make_unique<u32[]>(nnodes);
+	for (u32 i = 0; i < nnodes; ++i) new_id[i] = node_invalid;
+	for (u32 i = 0; i < order_nodes.size(); ++i) new_id[order_nodes[i]] = i;
+
+	// the edges follow their first node
+	std::vector<std::pair<u32, u32>> edge_keys;
+	for (u32 i = 0; i < nedges; ++i) {
+		auto const& e = edges_hot()[i];
+		if (e.nodea == node_invalid or e.nodeb == node_invalid) continue;
+		if (new_id[e.nodea] == node_invalid or new_id[e.nodeb] == node_invalid) continue;
+		edge_keys.push_back({ std::min(new_id[e.nodea], new_id[e.nodeb]), i });
+	}
+	std::sort(edge_keys.begin(), edge_keys.end());
+	auto new_edge = std::make_unique<u32[]>(nedges);
+	for (u32 i = 0; i < nedges; ++i) new_edge[i] = edge_invalid;
+	for (u32 i = 0; i < edge_keys.size(); ++i) new_edge[edge_keys[i].second] = i;
+
+	renumber(new_id.get(), order_nodes.size(), new_edge.get(), edge_keys.size());
+
+	// the tables to translate the ids of Graph_position
+	auto append_ids = [this](u32 size, auto const& fn) {
+		int offset = m_data.size();
+		m_data.emplace_back<Ids_t>().init(size, &m_data);
+		for (u32 i = 0; i < size; ++i) {
+			m_data.get<Ids_t>(offset)[i] = fn(i);
+		}
+		return offset;
+	};
+	node_internal_offset = append_ids(nnodes, [&](u32 i) { return new_id[i]; });
+	node_external_offset = append_ids(order_nodes.size(), [&](u32 i) { return order_nodes[i]; });
+	edge_internal_offset = append_ids(nedges, [&](u32 i) { return new_edge[i]; });
+	edge_external_offset = append_ids(edge_keys.size(), [&](u32 i) { return edge_keys[i].second; });
+}
+
+/**
+ * Append a Flat_array holding the elements of list to data and return its offset.
+ */
+template <typename Array_t, typename List>
+static int append_array(Buffer* data, List const& list) {
+	int offset = data->size();
+	data->emplace_back<Array_t>().init(list.size(), data);
+	for (u32 i = 0; i < list.size(); ++i) {
+		data->get<Array_t>(offset)[i] = list[i];
+	}
+	return offset;
+}
+
+/**
+ * Append the lists to data as one Flat_array of all their elements, preceded by an index holding
+ * the position of each list and their total size at the end. Returns the offsets of both.
+ */
+template <typename Array_t, typename Lists>
+static std::pair<int, int> append_lists(Buffer* data, Lists const& lists) {
+	std::vector<u32> index;
+	std::vector<typename Array_t::Type> items;
+	for (auto const& list: lists) {
+		index.push_back(items.size());
+		items.insert(items.end(), list.begin(), list.end());
+	}
+	index.push_back(items.size());
+	int index_offset = append_array<Graph::Arc_index_t>(data, index);
+	return {index_offset, append_array<Array_t>(data, items)};
+}
+
+void Graph::build_chains() {
+	assert(not m_mapped and chain_offset == -1);
+	u32 nnodes = nodes().size();
+	u32 nedges = edges_hot().size();
+	auto usable = [this](u32 edge) {
+		auto const& e = edges_hot()[edge];
+		return e.nodea != node_invalid and e.nodeb != node_invalid and (e.flags & 3);
+	};
+	auto other = [this](u32 edge, u32 node) {
+		auto const& e = edges_hot()[edge];
+		return e.nodea == node ? e.nodeb : e.nodea;
+	};
+
+	// the number of usable edges of each node and the first two of them
+	auto degree = std::make_unique<u32[]>(nnodes);
+	auto incident = std::make_unique<u32[]>(2 * nnodes);
+	for (u32 i = 0; i < nnodes; ++i) degree[i] = 0;
+	for (u32 i = 0; i < nedges; ++i) {
+		if (not usable(i)) continue;
+		for (u32 node: { edges_hot()[i].nodea, edges_hot()[i].nodeb }) {
+			if (degree[node] < 2) incident[2 * node + degree[node]] = i;
+			++degree[node];
+		}
+	}
+	auto next_edge = [&incident](u32 node, u32 edge) {
+		return incident[2 * node] == edge ? incident[2 * node + 1] : incident[2 * node];
+	};
+
+	// inner nodes have exactly two different neighbours, a self-loop counts as two edges
+	auto inner = std::make_unique<bool[]>(nnodes);
+	for (u32 i = 0; i < nnodes; ++i) {
+		if (degree[i] != 2) {
+			inner[i] = false;
+			continue;
+		}
+		u32 a = other(incident[2 * i], i), b = other(incident[2 * i + 1], i);
+		inner[i] = a != b and a != i and b != i;
+	}
+
+	std::vector<Chain> chain_list;
+	std::vector<u32> chain_edge_list;
+	std::vector<u32> node_chain_list (nnodes, chain_invalid);
+	auto done = std::make_unique<bool[]>(nedges);
+	for (u32 i = 0; i < nedges; ++i) done[i] = false;
+	for (u32 i = 0; i < nedges; ++i) {
+		if (done[i] or not usable(i)) continue;
+
+		// go back to the start of the chain containing the edge
+		u32 first = i, node = edges_hot()[i].nodea;
+		while (inner[node]) {
+			u32 e = next_edge(node, first);
+			if (e == i) {
+				// the chain is a cycle of inner nodes, let it start here
+				inner[node] = false;
+				break;
+			}
+			first = e;
+			node = other(e, node);
+		}
+
+		u32 c = chain_list.size();
+		Chain chain {node, node_invalid, 0, 3, (u32)chain_edge_list.size()};
+		for (u32 e = first;; e = next_edge(node, e)) {
+			auto const& edge = edges_hot()[e];
+			u32 flags = edge.nodea == node ? edge.flags : (edge.flags & 1) << 1 | (edge.flags & 2) >> 1;
+			chain.dist += edge.dist;
+			chain.flags &= flags;
+			chain_edge_list.push_back(e);
+			done[e] = true;
+			node = other(e, node);
+			if (not inner[node]) break;
+			node_chain_list[node] = c;
+		}
+		chain.nodeb = node;
+		chain_list.push_back(chain);
+	}
+
+	// the chains at each node of the overlay, leaving out self-loops as they are never part of a
+	// shortest path
+	auto at_begin = std::make_unique<u32[]>(nnodes + 1);
+	for (u32 i = 0; i <= nnodes; ++i) at_begin[i] = 0;
+	for (auto const& chain: chain_list) {
+		if (chain.nodea == chain.nodeb) continue;
+		++at_begin[chain.nodea + 1];
+		++at_begin[chain.nodeb + 1];
+	}
+	for (u32 i = 0; i < nnodes; ++i) at_begin[i + 1] += at_begin[i];
+	auto at = std::make_unique<u32[]>(at_begin[nnodes]);
+	{
+		auto at_size = std::make_unique<u32[]>(nnodes);
+		for (u32 i = 0; i < nnodes; ++i) at_size[i] = 0;
+		for (u32 c = 0; c < chain_list.size(); ++c) {
+			auto const& chain = chain_list[c];
+			if (chain.nodea == chain.nodeb) continue;
+			at[at_begin[chain.nodea] + at_size[chain.nodea]++] = c;
+			at[at_begin[chain.nodeb] + at_size[chain.nodeb]++] = c;
+		}
+	}
+	auto chain_arcs = [&](bool reverse) {
+		u32 flag_ab = reverse ? 2 : 1;
+		u32 flag_ba = reverse ? 1 : 2;
+		return [&, flag_ab, flag_ba](u32 node, auto&& fn) {
+			for (u32 j = at_begin[node]; j < at_begin[node + 1]; ++j) {
+				auto const& chain = chain_list[at[j]];
+				bool is_nodea = chain.nodea == node;
+				if (chain.flags & (is_nodea ? flag_ab : flag_ba)) {
+					fn(Arc {is_nodea ? chain.nodeb : chain.nodea, chain.dist, at[j],
+						chain.flags | (is_nodea ? arc_from_nodea : 0)});
+				}
+			}
+		};
+	};
+
+	chain_offset = append_array<Chains_t>(&m_data, chain_list);
+	chain_edges_offset = append_array<Ids_t>(&m_data, chain_edge_list);
+	node_chain_offset = append_array<Ids_t>(&m_data, node_chain_list);
+	std::tie(chain_out_index_offset, chain_out_offset) = append_arcs(&m_data, nnodes, chain_arcs(false));
+	std::tie(chain_in_index_offset,  chain_in_offset ) = append_arcs(&m_data, nnodes, chain_arcs(true));
+}
+
+void Graph::chain_fill(u32* dist, u32* prev, bool reverse) const {
+	u32 nnodes = nodes().size();
+	for (u32 i = 0; i < nnodes; ++i) {
+		if (prev[i] == node_invalid or not (prev[i] & prev_chain)) continue;
+		u32 c = prev[i] & ~prev_chain;
+		auto edges = chain_edges(c);
+		auto const& e = edges_hot()[chains()[c].nodeb == i ? edges.back() : edges.front()];
+		prev[i] = e.nodea == i ? e.nodeb : e.nodea;
+	}
+
+	for (u32 c = 0; c < chains().size(); ++c) {
+		auto const& chain = chains()[c];
+		auto edges = chain_edges(c);
+		// walk from each end of the chain towards the other one
+		for (int backwards = 0; backwards < 2; ++backwards) {
+			u32 node = backwards ? chain.nodeb : chain.nodea;
+			u32 d = dist[node];
+			for (int i = 0; i + 1 < edges.size() and d != dist_invalid; ++i) {
+				auto const& e = edges_hot()[edges[backwards ? edges.size() - 1 - i : i]];
+				bool from_nodea = e.nodea == node;
+				// a backward search goes the other way
+				if (not (e.flags & (from_nodea != reverse ? 1 : 2))) break;
+				u32 next = from_nodea ? e.nodeb : e.nodea;
+				d += e.dist;
+				if (d < dist[next]) {
+					dist[next] = d;
+					prev[next] = node;
+				}
+				node = next;
+			}
+		}
+	}
+}
+
+void Graph::build_hierarchy() {
+	assert(not m_mapped and shortcut_offset == -1);
+	// The number of nodes a witness search may settle. Higher values give fewer shortcuts, but
+	// take longer.
+	constexpr int witness_limit = 1000;
+	u32 nnodes = nodes().size();
+
+	// the remaining graph, ref is the chain or shortcut of an arc
+	struct Ch_arc {
+		u32 node, dist, ref;
+	};
+	std::vector<std::vector<Ch_arc>> out (nnodes), in (nnodes);
+	// add an arc, keeping only the shorter one of parallel arcs
+	auto add = [&out, &in](u32 from, u32 to, u32 dist, u32 ref) {
+		for (auto& a: out[from]) {
+			if (a.node != to) continue;
+			if (dist < a.dist) {
+				a = { to, dist, ref };
+				for (auto& b: in[to]) {
+					if (b.node == from) b = { from, dist, ref };
+				}
+			}
+			return;
+		}
+		out[from].push_back({ to, dist, ref });
+		in[to].push_back({ from, dist, ref });
+	};
+	for (u32 i = 0; i < nnodes; ++i) {
+		for (auto const& arc: chain_arcs_out(i)) add(i, arc.node, arc.dist, arc.edge);
+	}
+
+	// dijkstra from source avoiding skip, until the targets are settled or the distance is above
+	// limit
+	std::vector<u32> wdist (nnodes, dist_invalid);
+	std::vector<u8> wtarget (nnodes, 0);
+	std::vector<u32> touched;
+	Dist_heap wheap;
+	auto witness = [&](u32 source, u32 skip, u32 limit, int targets) {
+		for (u32 i: touched) wdist[i] = dist_invalid;
+		touched.clear();
+		wheap.reset(nnodes);
+		wdist[source] = 0;
+		touched.push_back(source);
+		wheap.push(source, 0);
+		for (int settled = 0; not wheap.empty() and settled < witness_limit and targets > 0; ++settled) {
+			auto el = wheap.pop();
+			if (el.dist > limit) break;
+			u32 node = el.node;
+			targets -= wtarget[node];
+			for (auto const& a: out[node]) {
+				u32 d = wdist[node] + a.dist;
+				if (a.node == skip or d >= wdist[a.node]) continue;
+				if (wdist[a.node] == dist_invalid) touched.push_back(a.node);
+				wheap.push(a.node, wdist[a.node] = d);
+			}
+		}
+	};
+
+	// calls fn(in arc, out arc) for each shortcut needed when contracting v, returns their number
+	auto for_shortcuts = [&](u32 v, auto const& fn) {
+		int count = 0;
+		for (auto const& a: in[v]) {
+			u32 limit = 0;
+			int targets = 0;
+			for (auto const& b: out[v]) {
+				if (b.node == a.node) continue;
+				limit = std::max(limit, a.dist + b.dist);
+				wtarget[b.node] = 1;
+				++targets;
+			}
+			if (not targets) continue;
+			witness(a.node, v, limit, targets);
+			for (auto const& b: out[v]) {
+				wtarget[b.node] = 0;
+				if (b.node == a.node or wdist[b.node] <= a.dist + b.dist) continue;
+				++count;
+				fn(a, b);
+			}
+		}
+		return count;
+	};
+
+	// contract the nodes with the fewest shortcuts and neighbours contracted first
+	std::vector<int> deleted (nnodes, 0);
+	std::vector<int> priority (nnodes, 0);
+	auto get_priority = [&](u32 v) {
+		int shortcuts = for_shortcuts(v, [](Ch_arc const&, Ch_arc const&) {});
+		return 2 * (shortcuts - (int)(in[v].size() + out[v].size())) + deleted[v];
+	};
+	auto queue = std::set<std::pair<int, u32>>();
+	for (u32 i = 0; i < nnodes; ++i) {
+		if (out[i].empty() and in[i].empty()) continue;
+		priority[i] = get_priority(i);
+		queue.insert({ priority[i], i });
+	}
+
+	std::vector<Shortcut> shortcut_list;
+	std::vector<std::vector<Ch_arc>> up (nnodes), down (nnodes);
+	while (not queue.empty()) {
+		u32 v = queue.begin()->second;
+		queue.erase(queue.begin());
+		// the priority may be outdated
+		priority[v] = get_priority(v);
+		if (not queue.empty() and priority[v] > queue.begin()->first) {
+			queue.insert({ priority[v], v });
+			continue;
+		}
+
+		for_shortcuts(v, [&](Ch_arc const& a, Ch_arc const& b) {
+			u32 ref = shortcut_list.size() | ch_shortcut;
+			shortcut_list.push_back({ a.node, v, b.node, a.ref, b.ref });
+			add(a.node, b.node, a.dist + b.dist, ref);
+		});
+
+		// the remaining arcs lead to nodes contracted later
+		up[v] = std::move(out[v]);
+		down[v] = std::move(in[v]);
+		out[v].clear();
+		in[v].clear();
+		std::vector<u32> neighbours;
+		for (auto const& b: up[v]) {
+			auto& arcs = in[b.node];
+			arcs.erase(std::remove_if(arcs.begin(), arcs.end(), [v](Ch_arc const& a) { return a.node == v; }), arcs.end());
+			neighbours.push_back(b.node);
+		}
+		for (auto const& a: down[v]) {
+			auto& arcs = out[a.node];
+			arcs.erase(std::remove_if(arcs.begin(), arcs.end(), [v](Ch_arc const& b) { return b.node == v; }), arcs.end());
+			neighbours.push_back(a.node);
+		}
+		std::sort(neighbours.begin(), neighbours.end());
+		neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+		for (u32 n: neighbours) {
+			++deleted[n];
+			queue.erase({ priority[n], n });
+			// cheap estimate, the priority is recomputed when n is popped
+			priority[n] += 1;
+			queue.insert({ priority[n], n });
+		}
+	}
+
+	auto ch_arcs = [](std::vector<std::vector<Ch_arc>> const& arcs) {
+		return [&arcs](u32 node, auto&& fn) {
+			for (auto const& a: arcs[node]) fn(Arc { a.node, a.dist, a.ref, 0 });
+		};
+	};
+	shortcut_offset = append_array<Shortcuts_t>(&m_data, shortcut_list);
+	std::tie(ch_up_index_offset,   ch_up_offset  ) = append_arcs(&m_data, nnodes, ch_arcs(up));
+	std::tie(ch_down_index_offset, ch_down_offset) = append_arcs(&m_data, nnodes, ch_arcs(down));
+}
+
+void Graph::build_landmarks() {
+	assert(not m_mapped and landmark_offset == -1);
+	u32 nnodes = nodes().size();
+	std::vector<u32> table (2 * landmark_count * nnodes, dist_invalid);
+
+	// dijkstra on the overlay, into dist
+	std::vector<u32> dist (nnodes);
+	Dist_heap heap;
+	auto search = [&](u32 source, bool reverse) {
+		std::fill(dist.begin(), dist.end(), dist_invalid);
+		heap.reset(nnodes);
+		heap.push(source, dist[source] = 0);
+		while (not heap.empty()) {
+			u32 node = heap.pop().node;
+			for (auto const& arc: reverse ? chain_arcs_in(node) : chain_arcs_out(node)) {
+				u32 d = dist[node] + arc.dist;
+				if (d >= dist[arc.node]) continue;
+				heap.push(arc.node, dist[arc.node] = d);
+			}
+		}
+	};
+
+	// Each landmark is the node farthest away from the ones selected before, the first one the
+	// node farthest away from some node.
+	u32 start = node_invalid;
+	for (u32 i = 0; i < nnodes and start == node_invalid; ++i) {
+		if (chain_arcs_out(i).size()) start = i;
+	}
+	std::vector<u32> nearest (nnodes, dist_invalid);
+	if (start != node_invalid) {
+		search(start, false);
+		nearest = dist;
+	}
+	for (int l = 0; l < landmark_count and start != node_invalid; ++l) {
+		u32 landmark = node_invalid;
+		for (u32 i = 0; i < nnodes; ++i) {
+			if (nearest[i] == dist_invalid) continue;
+			if (landmark == node_invalid or nearest[i] > nearest[landmark]) landmark = i;
+		}
+		// the graph has fewer nodes than landmarks
+		if (landmark == node_invalid or nearest[landmark] == 0) break;
+
+		search(landmark, false);
+		for (u32 i = 0; i < nnodes; ++i) {
+			table[2 * landmark_count * i + l] = dist[i];
+			if (l == 0 or dist[i] < nearest[i]) nearest[i] = dist[i];
+		}
+		search(landmark, true);
+		for (u32 i = 0; i < nnodes; ++i) {
+			table[2 * landmark_count * i + landmark_count + l] = dist[i];
+		}
+	}
+	landmark_offset = append_array<Landmark_dist_t>(&m_data, table);
+}
+
+u32 Graph::landmark_bound(u32 a, u32 b) const {
+	auto la = landmark_dist(a);
+	auto lb = landmark_dist(b);
+	u32 result = 0;
+	for (int l = 0; l < landmark_count; ++l) {
+		// d(l, b) <= d(l, a) + d(a, b)
+		u32 from_a = la[l], from_b = lb[l];
+		if (from_a != dist_invalid and from_b != dist_invalid and from_b > from_a) {
+			result = std::max(result, from_b - from_a);
+		}
+		// d(a, l) <= d(a, b) + d(b, l)
+		u32 to_a = la[landmark_count + l], to_b = lb[landmark_count + l];
+		if (to_a != dist_invalid and to_b != dist_invalid and to_a > to_b) {
+			result = std::max(result, to_a - to_b);
+		}
+	}
+	return result;
+}
+
+void Graph::build_hub_labels() {
+	assert(not m_mapped and hub_out_offset == -1 and shortcut_offset != -1);
+	double time_start = elapsed_time();
+	u64 max_bytes = (u64)options.hub_label_max_mb << 20;
+	u32 nnodes = nodes().size();
+
+	// A node is labeled after all the nodes above it in the hierarchy that it has arcs with, so
+	// the labels it is built from are finished. count is the number of those still missing.
+	std::vector<u32> count (nnodes, 0);
+	std::vector<std::vector<u32>> below (nnodes);
+	std::vector<u32> order;
+	for (u32 i = 0; i < nnodes; ++i) {
+		for (auto const& arc: ch_arcs_up(i))   below[arc.node].push_back(i);
+		for (auto const& arc: ch_arcs_down(i)) below[arc.node].push_back(i);
+		count[i] = ch_arcs_up(i).size() + ch_arcs_down(i).size();
+		if (not count[i]) order.push_back(i);
+	}
+	for (u32 k = 0; k < order.size(); ++k) {
+		for (u32 i: below[order[k]]) {
+			if (--count[i] == 0) order.push_back(i);
+		}
+	}
+	assert(order.size() == nnodes);
+
+	std::vector<std::vector<Hub>> out (nnodes), in (nnodes);
+	// the distance from a to b using label_a and the finished label of b, or the other way around
+	auto merge = [](std::vector<Hub> const& la, std::vector<Hub> const& lb) {
+		u32 result = dist_invalid;
+		for (u32 i = 0, j = 0; i < la.size() and j < lb.size();) {
+			if (la[i].node < lb[j].node) {
+				++i;
+			} else if (la[i].node > lb[j].node) {
+				++j;
+			} else {
+				result = std::min(result, la[i].dist + lb[j].dist);
+				++i;
+				++j;
+			}
+		}
+		return result;
+	};
+	// the label of node over the arcs, from the labels at their other ends
+	std::vector<u8> drop;
+	auto build = [&](u32 node, Array_view<Arc> arcs, std::vector<std::vector<Hub>>& labels,
+			std::vector<std::vector<Hub>> const& labels_other, bool reverse) {
+		auto& label = labels[node];
+		label.push_back({ node, 0 });
+		for (auto const& arc: arcs) {
+			for (auto hub: labels[arc.node]) label.push_back({ hub.node, hub.dist + arc.dist });
+		}
+		std::sort(label.begin(), label.end(), [](Hub a, Hub b) {
+			return a.node < b.node or (a.node == b.node and a.dist < b.dist);
+		});
+		label.erase(std::unique(label.begin(), label.end(), [](Hub a, Hub b) {
+			return a.node == b.node;
+		}), label.end());
+
+		// drop the hubs that can be reached shorter over another one
+		drop.assign(label.size(), 0);
+		for (u32 i = 0; i < label.size(); ++i) {
+			u32 hub = label[i].node;
+			if (hub == node) continue;
+			u32 d = reverse ? merge(labels_other[hub], label) : merge(label, labels_other[hub]);
+			drop[i] = d < label[i].dist;
+		}
+		u32 j = 0;
+		for (u32 i = 0; i < label.size(); ++i) {
+			if (not drop[i]) label[j++] = label[i];
+		}
+		label.resize(j);
+		label.shrink_to_fit();
+		return label.size();
+	};
+
+	u64 bytes = 0;
+	for (u32 node: order) {
+		bytes += build(node, ch_arcs_up(node), out, in, false) * sizeof(Hub);
+		bytes += build(node, ch_arcs_down(node), in, out, true) * sizeof(Hub);
+		if (bytes > max_bytes or elapsed_time() - time_start > options.hub_label_max_seconds) {
+			jerr << "Warning: Gave up building the hub labels of " << name() << " after "
+				 << (int)((elapsed_time() - time_start) * 1000.0) << "ms and " << nice_bytes(bytes)
+				 << endl;
+			return;
+		}
+	}
+
+	std::tie(hub_out_index_offset, hub_out_offset) = append_lists<Hubs_t>(&m_data, out);
+	std::tie(hub_in_index_offset,  hub_in_offset ) = append_lists<Hubs_t>(&m_data, in);
+}
+
+void Graph::build_pos_index() {
+	assert(not m_mapped and pos_grid_offset == -1);
+	u32 nnodes = nodes().size();
+
+	std::vector<std::vector<u32>> edges_of (nnodes);
+	for (u32 i = 0; i < (u32)edges_hot().size(); ++i) {
+		auto const& e = edges_hot()[i];
+		if (e.nodea == node_invalid or e.nodeb == node_invalid) continue;
+		edges_of[e.nodea].push_back(i);
+		if (e.nodeb != e.nodea) edges_of[e.nodeb].push_back(i);
+	}
+	std::tie(node_edges_index_offset, node_edges_offset) = append_lists<Ids_t>(&m_data, edges_of);
+
+	// The lengths are summed up in the order of the points, as pos did before they were stored,
+	// to get exactly the same floats.
+	std::vector<std::vector<float>> lengths (edges_hot().size());
+	for (u32 i = 0; i < (u32)edges_hot().size(); ++i) {
+		auto const& e = edges_hot()[i];
+		if (e.nodea == node_invalid or e.nodeb == node_invalid) continue;
+		Pos points[max_edge_points];
+		int n = edge_points(i, points);
+		float d = 0.f;
+		for (int j = 1; j < n; ++j) {
+			lengths[i].push_back(d += dist_air(points[j - 1], points[j]));
+		}
+	}
+	std::tie(edge_length_index_offset, edge_length_offset) = append_lists<Lengths_t>(&m_data, lengths);
+
+	// Only the nodes with edges are snapped to. The cells are made just large enough to hold about
+	// two of them on average.
+	constexpr u32 nodes_per_cell = 2;
+	u32 count = 0;
+	u16 min_lat = 0xffff, max_lat = 0, min_lon = 0xffff, max_lon = 0;
+	for (auto const& node: nodes()) {
+		if (node.edge == edge_invalid) continue;
+		min_lat = std::min(min_lat, node.pos.lat);
+		max_lat = std::max(max_lat, node.pos.lat);
+		min_lon = std::min(min_lon, node.pos.lon);
+		max_lon = std::max(max_lon, node.pos.lon);
+		++count;
+	}
+	if (not count) min_lat = max_lat = min_lon = max_lon = 0;
+	pos_grid_min = { min_lat, min_lon };
+	pos_grid_shift = 0;
+	while (true) {
+		pos_grid_rows = ((max_lat - min_lat) >> pos_grid_shift) + 1;
+		pos_grid_cols = ((max_lon - min_lon) >> pos_grid_shift) + 1;
+		u64 cells = (u64)pos_grid_rows * pos_grid_cols;
+		if (cells * nodes_per_cell <= std::max(count, nodes_per_cell)) break;
+		++pos_grid_shift;
+	}
+
+	std::vector<std::vector<u32>> cells ((u64)pos_grid_rows * pos_grid_cols);
+	for (u32 i = 0; i < nnodes; ++i) {
+		auto const& node = nodes()[i];
+		if (node.edge == edge_invalid) continue;
+		int row = (node.pos.lat - min_lat) >> pos_grid_shift;
+		int col = (node.pos.lon - min_lon) >> pos_grid_shift;
+		cells[row * pos_grid_cols + col].push_back(i);
+	}
+	std::vector<u16> lat, lon;
+	for (auto const& cell: cells) {
+		for (u32 node: cell) {
+			lat.push_back(nodes()[node].pos.lat);
+			lon.push_back(nodes()[node].pos.lon);
+		}
+	}
+	std::tie(pos_grid_index_offset, pos_grid_offset) = append_lists<Ids_t>(&m_data, cells);
+	pos_grid_lat_offset = append_array<Coords_t>(&m_data, lat);
+	pos_grid_lon_offset = append_array<Coords_t>(&m_data, lon);
+}
+
+void Graph::init(Buffer_view name, Buffer_view node_filename, Buffer_view edge_filename,
+		Buffer_view geometry_filename, Graph_options const& options_) {
+	m_file.close();
+	m_mapped = nullptr;
 	m_data.reset();
+	pos_cache.reset();
+	cache_path.reset();
+	cache_stamp = 0;
+	options = options_;
+	node_internal_offset = node_external_offset = -1;
+	edge_internal_offset = edge_external_offset = -1;
+	chain_offset = chain_edges_offset = node_chain_offset = -1;
+	shortcut_offset = -1;
+	landmark_offset = -1;
+	hub_out_index_offset = hub_out_offset = hub_in_index_offset = hub_in_offset = -1;
+	pos_grid_index_offset = pos_grid_offset = node_edges_index_offset = node_edges_offset = -1;
+	pos_grid_lat_offset = pos_grid_lon_offset = -1;
+	edge_length_index_offset = edge_length_offset = -1;
 
 	name_offset = m_data.size();
 	name_size = name.size();
 	m_data.append(name);
 	m_data.append("", 1);
 
-	std::ifstream file;
-	auto read16 = [&file]() -> s16 {
-		return file.get() << 8 | file.get();
-	};
-	auto read32 = [&file]() -> s32 {
-		s32 r = 0;
-		for (u8 i = 0; i < 4; ++i) {
-			r = (r << 8) | file.get();
+	// The files are mapped as a whole, the headers are big-endian while the records are stored in
+	// native byte order.
+	Mapped_file node_file, edge_file, geometry_file;
+	auto map_file = [](Mapped_file* file, Buffer_view filename) {
+		if (not file->init(filename) or file->data().size() < gh_header_size) {
+			jerr << "Error: Could not read the GraphHopper file " << filename.c_str() << '\n';
+			die(false);
 		}
-		return r;
-	};
-	auto read64 = [&file]() -> s64 {
-		s64 r = 0;
-		for (u8 i = 0; i < 8; ++i) {
-			r = (r << 8) | file.get();
-		}
-		return r;
+		return GH_reader {file->data().data()};
 	};
 
 	// nodes
-	file.open(node_filename.c_str(), std::ios::in | std::ios::binary);
+	auto reader = map_file(&node_file, node_filename);
 	// basic header
-	read16();
+	reader.read16();
 	// "GH"
-	assert(read16() == 0x4748);
+	assert(reader.read16() == 0x4748);
 	// file length
-	read64();
-	read32();
+	reader.read64();
+	reader.read32();
 
 	// nodes header
-	read32();
+	reader.read32();
 	// element length
-	assert(read32() == 12);
-	s32 node_count = read32();
-	map_min_lon = read32() / int_deg_fac;
-	map_max_lon = read32() / int_deg_fac;
-	map_min_lat = read32() / int_deg_fac;
-	map_max_lat = read32() / int_deg_fac;
+	assert(reader.read32() == 12);
+	s32 node_count = reader.read32();
+	map_min_lon = reader.read32() / int_deg_fac;
+	map_max_lon = reader.read32() / int_deg_fac;
+	map_min_lat = reader.read32() / int_deg_fac;
+	map_max_lat = reader.read32() / int_deg_fac;
 	float lon_radius = std::cos((map_max_lat + map_min_lat) / 360. * M_PI) * radius_earth;
 	auto pmin = get_pos_back({ 0, 0 });
 	auto pmax = get_pos_back({ 65535, 65535 });
 	map_scale_lat = (pmax.first - pmin.first) / 180.f * (radius_earth * M_PI) / 65535.f;
 	map_scale_lon = (pmax.second - pmin.second) / 180.f * (lon_radius   * M_PI) / 65535.f;
-	file.close();
+	assert(node_file.data().size() >= gh_header_size + node_count * (int)sizeof(GH_Node));
 
-	file.open(edge_filename.c_str(), std::ios::in | std::ios::binary);
+	reader = map_file(&edge_file, edge_filename);
 	// basic header
-	read16();
+	reader.read16();
 	// "GH"
-	assert(read16() == 0x4748);
+	assert(reader.read16() == 0x4748);
 	// file length
-	read64();
-	read32();
+	reader.read64();
+	reader.read32();
 
 	// edges header
 	// element length
-	assert(read32() == 32);
-	s32 edge_count = read32();
-	file.close();
+	assert(reader.read32() == 32);
+	s32 edge_count = reader.read32();
+	assert(edge_file.data().size() >= gh_header_size + edge_count * (int)sizeof(GH_Edge));
 
-	file.open(geometry_filename.c_str(), std::ios::in | std::ios::binary);
+	reader = map_file(&geometry_file, geometry_filename);
 	// basic header
-	read16();
+	reader.read16();
 	// "GH"
-	assert(read16() == 0x4748);
+	assert(reader.read16() == 0x4748);
 	// file length
-	read64();
-	read32();
+	reader.read64();
+	reader.read32();
 
 	// geometry header
 	// data length
-	s64 geometry_length = read32() + ((u64)read32() << 32);
-	file.close();
+	s64 geometry_length = (u32)reader.read32() + ((u64)reader.read32() << 32);
+	assert(geometry_file.data().size() >= gh_header_size + geometry_length * (s64)sizeof(s32));
 
-	auto g = m_data.reserve_guard(
-		Nodes_t::total_space(node_count) + Edges_t::total_space(edge_count) + 2 * geometry_length
-	);
+	// an encoded point takes at most 6 bytes, GraphHopper uses two s32
+	m_data.reserve_space(Nodes_t::total_space(node_count) + Edges_hot_t::total_space(edge_count)
+		+ Edges_cold_t::total_space(edge_count) + Geometry_t::total_space(3 * geometry_length));
+	auto g = m_data.alloc_guard();
 
 	// node data
-	file.open(node_filename.c_str(), std::ios::in | std::ios::binary);
-	file.seekg(100, file.beg);
 	node_offset = m_data.size();
 	auto& nodes = m_data.emplace_back<Nodes_t>();
 	nodes.init(&m_data);
-	for (s32 i = 0; i < node_count; ++i) {
-		GH_Node node;
-		file.read((char*)&node, sizeof(node));
-		nodes.push_back({ (u32)node.edge_ref, get_pos_gh(*this, node) }, &m_data);
-	}
-	file.close();
-
-	// edge data
-	file.open(edge_filename.c_str(), std::ios::in | std::ios::binary);
-	file.seekg(100, file.beg);
-	edge_offset = m_data.size();
-	auto& edges = m_data.emplace_back<Edges_t>();
-	edges.init(&m_data);
-	for (u32 i = 0; i < (u32)edge_count; ++i) {
-		GH_Edge edge;
-		file.read((char*)&edge, sizeof(edge));
-		edges.push_back({ (u32)edge.nodea, (u32)edge.nodeb, (u32)edge.linka,
-			(u32)edge.linkb, (u32)edge.dist, (u32)edge.flags, (u32)edge.geo, (u32)edge.name }, &m_data);
+	m_data.addsize(node_count * sizeof(Node));
+	nodes.m_size() = node_count;
+	{
+		auto gh_nodes = (GH_Node const*)(node_file.data().data() + gh_header_size);
+		Node* out = nodes.begin();
+		for (s32 i = 0; i < node_count; ++i) {
+			out[i] = { (u32)gh_nodes[i].edge_ref, get_pos_gh(*this, gh_nodes[i]) };
+		}
 	}
+	node_file.close();
+
+	// edge data, split into the part needed by the searches and the rest
+	auto gh_edges = (GH_Edge const*)(edge_file.data().data() + gh_header_size);
+	edge_hot_offset = m_data.size();
+	auto& hot = m_data.emplace_back<Edges_hot_t>();
+	hot.init(&m_data);
+	m_data.addsize(edge_count * sizeof(Edge_hot));
+	hot.m_size() = edge_count;
+	for (s32 i = 0; i < edge_count; ++i) {
+		auto const& e = gh_edges[i];
+		// fix out-of-bound nodes
+		u32 nodea = (u32)e.nodea < (u32)node_count ? (u32)e.nodea : node_invalid;
+		u32 nodeb = (u32)e.nodeb < (u32)node_count ? (u32)e.nodeb : node_invalid;
+		hot[i] = { nodea, nodeb, (u32)e.dist, (u32)e.flags };
+	}
+
+	edge_cold_offset = m_data.size();
+	auto& cold = m_data.emplace_back<Edges_cold_t>();
+	cold.init(&m_data);
+	m_data.addsize(edge_count * sizeof(Edge_cold));
+	cold.m_size() = edge_count;
+
+	// geometry data, encoded in the order of the edges. GraphHopper stores the number of pillar
+	// points at the offset of the edge, followed by the points. Offset 0 means no pillar points.
+	geometry_offset = m_data.size();
+	m_data.emplace_back<Geometry_t>().init(&m_data);
 	{
-		// remove subnetworks by running Tarjan's strongly connected components algorithm
-		auto in_main = std::make_unique<bool[]>(nodes.size());
-		auto index = std::make_unique<u32[]>(nodes.size());
-		auto lowlink = std::make_unique<u32[]>(nodes.size());
-		auto stack_pos = std::make_unique<u32[]>(nodes.size());
-		auto stack = std::make_unique<u32[]>(nodes.size());
-		for (u32 i = 0; i < nodes.size(); ++i) {
-			in_main[i] = false;
-			index[i] = lowlink[i] = stack[i] = stack_pos[i] = node_invalid;
-		}
-		struct Call_stack_t {
-			u32 node;
-			u32 other;
-			Edge_iterator it;
-		};
-		auto call_stack = std::make_unique<Call_stack_t[]>(nodes.size());
-		u32 current_index = 0;
-
-		const Edge_iterator it_invalid{};
-		for (u32 i = 0; i < nodes.size(); ++i) {
-			if (index[i] == node_invalid) {
-				u32 node = i;
-				u32 stack_size = 0;
-				u32 call_depth = 0;
-			new_node:
-				index[node] = lowlink[node] = current_index++;
-				stack[stack_size] = node;
-				stack_pos[node] = stack_size++;
-				call_stack[++call_depth] = { node, node_invalid, nodes[node].iter(*this).begin() };
-			next_edge:
-				auto& call = call_stack[call_depth];
-				node = call.node;
-				auto it = call.it;
-				if (it == it_invalid) {
-					if (lowlink[node] == index[node]) {
-						if (stack_size - stack_pos[node] > nodes.size() / 2) {
-							while (stack_size-- > stack_pos[node]) {
-								in_main[stack[stack_size]] = true;
-							}
-							goto prune;
-						} else {
-							u32 c = node_invalid;
-							while (c != node) {
-								assert(stack_size > 0);
-								c = stack[--stack_size];
-								stack_pos[c] = node_invalid;
-							}
-						}
-					}
-					--call_depth;
-					auto& call = call_stack[call_depth];
-					node = call.node;
-					u32 other = call.other;
-					assert(other != node_invalid);
-					u32 l = lowlink[other];
-					if (l < lowlink[node]) lowlink[node] = l;
-					goto next_edge;
-				}
-				++call.it;
-				u32 flags = edges[it.edge].flags;
-				if (it.is_nodea and (flags & 1) == 0) goto next_edge;
-				if (!it.is_nodea and (flags & 2) == 0) goto next_edge;
-				u32 other = it.is_nodea ? it->nodeb : it->nodea;
-				assert(other != node_invalid);
-				if (index[other] == node_invalid) {
-					call.other = other;
-					node = other;
-					goto new_node;
-				} else if (stack_pos[other] != node_invalid) {
-					u32 i = index[other];
-					if (i < lowlink[node]) lowlink[node] = i;
-				}
-				goto next_edge;
+		int geometry_begin = m_data.size();
+		auto gh_geo = (s32 const*)(geometry_file.data().data() + gh_header_size);
+		for (s32 i = 0; i < edge_count; ++i) {
+			cold[i] = { (u32)(m_data.size() - geometry_begin), (u32)gh_edges[i].name };
+			s64 ofs = (u32)gh_edges[i].geo;
+			if (ofs == 0 or hot[i].nodea == node_invalid) continue;
+			assert(ofs < geometry_length);
+			s32 size = gh_geo[ofs++];
+			if (size < 0) size = 0;
+			assert(size <= max_edge_points - 2);
+			assert(ofs + 2 * size <= geometry_length);
+
+			Pos last = nodes[hot[i].nodea].pos;
+			for (s32 j = 0; j < size; ++j, ofs += 2) {
+				Pos p = get_pos_gh(*this, gh_geo[ofs], gh_geo[ofs + 1]);
+				append_varint(&m_data, p.lat - last.lat);
+				append_varint(&m_data, p.lon - last.lon);
+				last = p;
 			}
 		}
-		assert(false);
-	prune:
-		for (u32 i = 0; i < nodes.size(); ++i) {
-			if (not in_main[i]) {
-				auto& node = nodes[i];
-				if (node.edge != edge_invalid) {
-					auto range = node.iter(*this);
-					for (auto it = range.begin(); it != range.end();) {
-						if (it.is_nodea) {
-							auto& nodeb = nodes[it->nodeb];
-							if (nodeb.edge == it.edge) nodeb.edge = it->linkb;
-							else {
-								for (auto& edge : nodeb.iter(*this)) {
-									if (edge.linka == it.edge) {
-										const_cast<Edge&>(edge).linka = it->linkb;
-										break;
-									}
-									if (edge.linkb == it.edge) {
-										const_cast<Edge&>(edge).linkb = it->linkb;
-										break;
-									}
-								}
-							}
-						} else {
-							auto& nodea = nodes[it->nodea];
-							if (nodea.edge == it.edge) nodea.edge = it->linka;
-							else {
-								for (auto& edge : nodea.iter(*this)) {
-									if (edge.linka == it.edge) {
-										const_cast<Edge&>(edge).linka = it->linka;
-										break;
-									}
-									if (edge.linkb == it.edge) {
-										const_cast<Edge&>(edge).linkb = it->linka;
-										break;
-									}
-								}
-							}
-						}
-						auto& edge = const_cast<Edge&>(*it);
-						++it;
-						edge.nodea =
-							edge.nodeb = node_invalid;
-					}
-					node.edge = edge_invalid;
+		m_data.get<Geometry_t>(geometry_offset).m_size() = m_data.size() - geometry_begin;
+	}
+	geometry_file.close();
+	g.free();
+
+	// GraphHopper keeps the edges of each node in a linked list, going through linka at nodea and
+	// through linkb at nodeb. The adjacency arrays keep that order.
+	auto in_main = std::make_unique<bool[]>(node_count);
+	for (s32 i = 0; i < node_count; ++i) in_main[i] = true;
+	auto gh_arcs = [this, gh_edges, &in_main](bool reverse) {
+		// the flags that allow travelling along an edge from nodea to nodeb, and the other way round
+		u32 flag_ab = reverse ? 2 : 1;
+		u32 flag_ba = reverse ? 1 : 2;
+		return [this, gh_edges, &in_main, flag_ab, flag_ba](u32 node, auto&& fn) {
+			if (not in_main[node]) return;
+			for (u32 e = this->nodes()[node].edge; e != edge_invalid;) {
+				auto const& edge = gh_edges[e];
+				bool is_nodea = (u32)edge.nodea == node;
+				u32 other = is_nodea ? edges_hot()[e].nodeb : edges_hot()[e].nodea;
+				if (other != node_invalid and in_main[other] and (edge.flags & (is_nodea ? flag_ab : flag_ba))) {
+					fn(Arc {other, (u32)edge.dist, e, (u32)edge.flags | (is_nodea ? arc_from_nodea : 0)});
 				}
+				e = (u32)(is_nodea ? edge.linka : edge.linkb);
+			}
+		};
+	};
+
+	// remove subnetworks by running Tarjan's strongly connected components algorithm on the arcs
+	{
+		int arcs_begin = m_data.size();
+		auto offsets = append_arcs(&m_data, node_count, gh_arcs(false));
+		auto comp = std::make_unique<u32[]>(node_count);
+		u32 main_comp = largest_scc(node_count, &get<Arc_index_t>(offsets.first)[0],
+			get<Arcs_t>(offsets.second).begin(), comp.get());
+		for (s32 i = 0; i < node_count; ++i) {
+			in_main[i] = comp[i] == main_comp;
+			if (not in_main[i]) m_data.get<Nodes_t>(node_offset)[i].edge = edge_invalid;
+		}
+		for (s32 i = 0; i < edge_count; ++i) {
+			auto& e = m_data.get<Edges_hot_t>(edge_hot_offset)[i];
+			if (e.nodea == node_invalid or e.nodeb == node_invalid or not in_main[e.nodea]
+					or not in_main[e.nodeb]) {
+				e.nodea = e.nodeb = node_invalid;
 			}
 		}
+		m_data.resize(arcs_begin);
 	}
-	for (u32 i = 0; i < (u32)edge_count; ++i) {
-		auto& e = edges[i];
-		// fix out-of-bound nodes
-		if (e.nodea >= (u32)node_count) {
-			e.nodea = node_invalid;
+	std::tie(arc_out_index_offset, arc_out_offset) = append_arcs(&m_data, node_count, gh_arcs(false));
+	std::tie(arc_in_index_offset,  arc_in_offset ) = append_arcs(&m_data, node_count, gh_arcs(true));
+	edge_file.close();
+
+	if (options.crop) crop(options);
+	if (options.reorder) reorder(options.reorder);
+	build_chains();
+	build_hierarchy();
+	build_landmarks();
+	if (options.hub_label_max_mb) build_hub_labels();
+	build_pos_index();
+}
+
+// Magic number and version of the graph cache. Increment the version whenever the contents of
+// m_data or Graph_cache_header change.
+static constexpr u32 graph_cache_magic = 0x6863676c;
+static constexpr u32 graph_cache_version = 13;
+
+/**
+ * The header of a graph cache file, it is followed by data_size bytes of m_data.
+ */
+struct Graph_cache_header {
+	u32 magic;
+	u32 version;
+	u64 source_size[3];
+	u64 source_mtime[3];
+
+	Graph_options options;
+
+	double map_min_lat, map_max_lat, map_min_lon, map_max_lon;
+	float map_scale_lat, map_scale_lon;
+
+	s32 node_offset, edge_hot_offset, edge_cold_offset, geometry_offset, name_offset;
+	s32 arc_out_index_offset, arc_out_offset, arc_in_index_offset, arc_in_offset;
+	s32 node_internal_offset, node_external_offset, edge_internal_offset, edge_external_offset;
+	s32 chain_offset, chain_edges_offset, node_chain_offset;
+	s32 chain_out_index_offset, chain_out_offset, chain_in_index_offset, chain_in_offset;
+	s32 shortcut_offset, ch_up_index_offset, ch_up_offset, ch_down_index_offset, ch_down_offset;
+	s32 landmark_offset;
+	s32 hub_out_index_offset, hub_out_offset, hub_in_index_offset, hub_in_offset;
+	s32 pos_grid_index_offset, pos_grid_offset, node_edges_index_offset, node_edges_offset;
+	s32 pos_grid_lat_offset, pos_grid_lon_offset;
+	s32 edge_length_index_offset, edge_length_offset;
+	Pos pos_grid_min;
+	s32 pos_grid_shift, pos_grid_rows, pos_grid_cols;
+	s32 name_size;
+	s32 data_size;
+};
+// The data is mapped directly behind the header, keep it aligned
+static_assert(sizeof(Graph_cache_header) % 8 == 0, "Graph_cache_header breaks alignment");
+
+/**
+ * Write data into a temporary file next to filename, then move it over filename. If the process is
+ * killed in between, the old file stays as it was.
+ */
+static void write_file_replace(Buffer_view data, Buffer_view filename) {
+	Buffer tmp;
+	tmp.append(filename);
+	tmp.append(".tmp");
+	tmp.append0();
+	std::ofstream o {tmp.data(), std::ios::out | std::ios::binary};
+	o.write(data.data(), data.size());
+	o.close();
+	if (not o or not file_replace(tmp.data(), filename)) {
+		jerr << "Warning: Could not write " << filename.c_str() << '\n';
+		std::remove(tmp.data());
+	}
+}
+
+/**
+ * A hash of the fields of a cache header that init_cached compares, to tell apart the graphs that
+ * other caches are derived from. The padding of the header is not initialized, so only the named
+ * fields go in.
+ */
+static u32 cache_stamp_hash(Graph_cache_header const& h) {
+	Buffer fields;
+	auto add = [&fields](auto const& field) { fields.append(&field, sizeof(field)); };
+	add(h.magic);
+	add(h.version);
+	for (int i = 0; i < 3; ++i) {
+		add(h.source_size[i]);
+		add(h.source_mtime[i]);
+	}
+	auto const& o = h.options;
+	add(o.crop);
+	if (o.crop) {
+		add(o.crop_min_lat);
+		add(o.crop_max_lat);
+		add(o.crop_min_lon);
+		add(o.crop_max_lon);
+	}
+	add(o.reorder);
+	add(o.hub_label_max_mb);
+	if (o.hub_label_max_mb) add(o.hub_label_max_seconds);
+	return Buffer_view {fields}.get_hash();
+}
+
+bool Graph::init_cached(Buffer_view name, Buffer_view node_filename, Buffer_view edge_filename,
+		Buffer_view geometry_filename, Buffer_view cache_filename, Graph_options const& options_) {
+	// Only the fields of stamp are compared and hashed, its padding is undefined
+	Graph_cache_header stamp {};
+	stamp.magic = graph_cache_magic;
+	stamp.version = graph_cache_version;
+	stamp.options = options_;
+	auto remember_cache = [this, &stamp, cache_filename]() {
+		cache_path.reset();
+		cache_path.append(cache_filename);
+		cache_path.append0();
+		cache_stamp = cache_stamp_hash(stamp);
+	};
+	Buffer_view sources[] = { node_filename, edge_filename, geometry_filename };
+	for (int i = 0; i < 3; ++i) {
+		if (not file_stat(sources[i], &stamp.source_size[i], &stamp.source_mtime[i])) {
+			jerr << "Warning: Could not stat " << sources[i].c_str() << ", not using the cache.\n";
+			init(name, node_filename, edge_filename, geometry_filename, options_);
+			return false;
 		}
-		if (e.nodeb >= (u32)node_count) {
-			e.nodeb = node_invalid;
+	}
+
+	m_file.close();
+	m_mapped = nullptr;
+	pos_cache.reset();
+	if (m_file.init(cache_filename) and m_file.data().size() >= (int)sizeof(Graph_cache_header)) {
+		auto const& h = *(Graph_cache_header const*)m_file.data().data();
+		bool valid = h.magic == stamp.magic and h.version == stamp.version
+			and std::memcmp(h.source_size,  stamp.source_size,  sizeof(h.source_size )) == 0
+			and std::memcmp(h.source_mtime, stamp.source_mtime, sizeof(h.source_mtime)) == 0
+			and h.options == stamp.options
+			and h.data_size == m_file.data().size() - (int)sizeof(Graph_cache_header);
+		// Only view the data once its size is known to fit, a broken file is simply rebuilt
+		Buffer_view cached_data;
+		if (valid) cached_data = { m_file.data().data() + sizeof(Graph_cache_header), h.data_size };
+		valid = valid and h.name_offset >= 0 and h.name_size >= 0
+			and h.name_offset + h.name_size <= h.data_size
+			and Buffer_view {cached_data.data() + h.name_offset, h.name_size} == name;
+
+		if (valid) {
+			m_data.free();
+			m_mapped = cached_data;
+			options = h.options;
+			map_min_lat = h.map_min_lat;
+			map_max_lat = h.map_max_lat;
+			map_min_lon = h.map_min_lon;
+			map_max_lon = h.map_max_lon;
+			map_scale_lat = h.map_scale_lat;
+			map_scale_lon = h.map_scale_lon;
+			node_offset = h.node_offset;
+			edge_hot_offset = h.edge_hot_offset;
+			edge_cold_offset = h.edge_cold_offset;
+			geometry_offset = h.geometry_offset;
+			name_offset = h.name_offset;
+			arc_out_index_offset = h.arc_out_index_offset;
+			arc_out_offset = h.arc_out_offset;
+			arc_in_index_offset = h.arc_in_index_offset;
+			arc_in_offset = h.arc_in_offset;
+			node_internal_offset = h.node_internal_offset;
+			node_external_offset = h.node_external_offset;
+			edge_internal_offset = h.edge_internal_offset;
+			edge_external_offset = h.edge_external_offset;
+			chain_offset = h.chain_offset;
+			chain_edges_offset = h.chain_edges_offset;
+			node_chain_offset = h.node_chain_offset;
+			chain_out_index_offset = h.chain_out_index_offset;
+			chain_out_offset = h.chain_out_offset;
+			chain_in_index_offset = h.chain_in_index_offset;
+			chain_in_offset = h.chain_in_offset;
+			shortcut_offset = h.shortcut_offset;
+			ch_up_index_offset = h.ch_up_index_offset;
+			ch_up_offset = h.ch_up_offset;
+			ch_down_index_offset = h.ch_down_index_offset;
+			ch_down_offset = h.ch_down_offset;
+			landmark_offset = h.landmark_offset;
+			hub_out_index_offset = h.hub_out_index_offset;
+			hub_out_offset = h.hub_out_offset;
+			hub_in_index_offset = h.hub_in_index_offset;
+			hub_in_offset = h.hub_in_offset;
+			pos_grid_index_offset = h.pos_grid_index_offset;
+			pos_grid_offset = h.pos_grid_offset;
+			pos_grid_lat_offset = h.pos_grid_lat_offset;
+			pos_grid_lon_offset = h.pos_grid_lon_offset;
+			node_edges_index_offset = h.node_edges_index_offset;
+			node_edges_offset = h.node_edges_offset;
+			edge_length_index_offset = h.edge_length_index_offset;
+			edge_length_offset = h.edge_length_offset;
+			pos_grid_min = h.pos_grid_min;
+			pos_grid_shift = h.pos_grid_shift;
+			pos_grid_rows = h.pos_grid_rows;
+			pos_grid_cols = h.pos_grid_cols;
+			name_size = h.name_size;
+			remember_cache();
+			return true;
 		}
 	}
-	file.close();
 
-	// geometry data
-	file.open(geometry_filename.c_str(), std::ios::in | std::ios::binary);
-	file.seekg(100, file.beg);
-	geometry_offset = m_data.size();
-	s64 ofs = 0;
-	while (ofs < geometry_length) {
-		s32 size;
-		struct {
-			s32 lat, lon;
-		} pos;
+	// the file is replaced below, which does not work while it is mapped
+	m_file.close();
+	init(name, node_filename, edge_filename, geometry_filename, options_);
+
+	Buffer out;
+	out.reserve(sizeof(Graph_cache_header) + m_data.size());
+	auto& h = out.emplace_back<Graph_cache_header>(stamp);
+	h.map_min_lat = map_min_lat;
+	h.map_max_lat = map_max_lat;
+	h.map_min_lon = map_min_lon;
+	h.map_max_lon = map_max_lon;
+	h.map_scale_lat = map_scale_lat;
+	h.map_scale_lon = map_scale_lon;
+	h.node_offset = node_offset;
+	h.edge_hot_offset = edge_hot_offset;
+	h.edge_cold_offset = edge_cold_offset;
+	h.geometry_offset = geometry_offset;
+	h.name_offset = name_offset;
+	h.arc_out_index_offset = arc_out_index_offset;
+	h.arc_out_offset = arc_out_offset;
+	h.arc_in_index_offset = arc_in_index_offset;
+	h.arc_in_offset = arc_in_offset;
+	h.node_internal_offset = node_internal_offset;
+	h.node_external_offset = node_external_offset;
+	h.edge_internal_offset = edge_internal_offset;
+	h.edge_external_offset = edge_external_offset;
+	h.chain_offset = chain_offset;
+	h.chain_edges_offset = chain_edges_offset;
+	h.node_chain_offset = node_chain_offset;
+	h.chain_out_index_offset = chain_out_index_offset;
+	h.chain_out_offset = chain_out_offset;
+	h.chain_in_index_offset = chain_in_index_offset;
+	h.chain_in_offset = chain_in_offset;
+	h.shortcut_offset = shortcut_offset;
+	h.ch_up_index_offset = ch_up_index_offset;
+	h.ch_up_offset = ch_up_offset;
+	h.ch_down_index_offset = ch_down_index_offset;
+	h.ch_down_offset = ch_down_offset;
+	h.landmark_offset = landmark_offset;
+	h.hub_out_index_offset = hub_out_index_offset;
+	h.hub_out_offset = hub_out_offset;
+	h.hub_in_index_offset = hub_in_index_offset;
+	h.hub_in_offset = hub_in_offset;
+	h.pos_grid_index_offset = pos_grid_index_offset;
+	h.pos_grid_offset = pos_grid_offset;
+	h.pos_grid_lat_offset = pos_grid_lat_offset;
+	h.pos_grid_lon_offset = pos_grid_lon_offset;
+	h.node_edges_index_offset = node_edges_index_offset;
+	h.node_edges_offset = node_edges_offset;
+	h.edge_length_index_offset = edge_length_index_offset;
+	h.edge_length_offset = edge_length_offset;
+	h.pos_grid_min = pos_grid_min;
+	h.pos_grid_shift = pos_grid_shift;
+	h.pos_grid_rows = pos_grid_rows;
+	h.pos_grid_cols = pos_grid_cols;
+	h.name_size = name_size;
+	h.data_size = m_data.size();
+	out.append(m_data);
+	write_file_replace(out, cache_filename);
+	remember_cache();
+	return false;
+}
 
-		file.read((char*)&size, sizeof(size));
-		assert(size <= std::numeric_limits<Geometry_t::Size_t>::max());
-		++ofs;
+// Magic number and version of the Dist_cache files, see Dist_cache::load
+static constexpr u32 dist_cache_magic = 0x6463676c;
+static constexpr u32 dist_cache_version = 1;
+
+/**
+ * The header of a Dist_cache file. It is followed by the positions of the facilities, the distances
+ * between them row by row, lookup_buffer, lookup_data and lookup_shifts.
+ */
+struct Dist_cache_header {
+	u32 magic;
+	u32 version;
+	u32 graph_stamp;
+	s32 facility_count;
+	u32 lookup_routes;
+	s32 lookup_buffer_size, lookup_data_size, lookup_shifts_size;
+};
 
-		auto& geo = m_data.emplace_back<Geometry_t>();
-		geo.init(&m_data);
-		for (s32 i = 0; i < size; ++i) {
-			file.read((char*)&pos, sizeof(pos));
-			ofs += 2;
-			geo.push_back(get_pos_gh(*this, pos.lat, pos.lon), &m_data);
-		}
+bool Dist_cache::cache_filename(Buffer* out) const {
+	assert(out);
+	if (graph->cache_path.size() == 0) return false;
+	u32 hash = Buffer_view {positions.data(), facility_count * (int)sizeof(Graph_position)}.get_hash();
+	out->append(graph->cache_path.data());
+	out->append(jup_printf(".dist%08x", hash));
+	out->append0();
+	return true;
+}
+
+bool Dist_cache::load(Buffer_view filename) {
+	assert(size == facility_count);
+	join_lookups();
+	Mapped_file file;
+	if (not file.init(filename) or file.data().size() < (int)sizeof(Dist_cache_header)) return false;
+	auto const& h = *(Dist_cache_header const*)file.data().data();
+	int positions_size = facility_count * sizeof(Graph_position);
+	int distances_size = facility_count * facility_count * sizeof(u16);
+	bool valid = h.magic == dist_cache_magic and h.version == dist_cache_version
+		and h.graph_stamp == graph->cache_stamp and h.facility_count == facility_count
+		and h.lookup_routes == lookup_routes
+		and file.data().size() == (int)sizeof(Dist_cache_header) + positions_size + distances_size
+			+ h.lookup_buffer_size + h.lookup_data_size + h.lookup_shifts_size;
+	char const* ptr = file.data().data() + sizeof(Dist_cache_header);
+	// the file name only has a hash of the positions, compare all of them
+	if (not valid or std::memcmp(ptr, positions.data(), positions_size) != 0) return false;
+	ptr += positions_size;
+
+	for (int a = 0; a < facility_count; ++a) {
+		std::memcpy(&m_dist(a, 0), ptr, facility_count * sizeof(u16));
+		ptr += facility_count * sizeof(u16);
+	}
+	lookup_buffer.reset();
+	lookup_buffer.append(ptr, h.lookup_buffer_size);
+	ptr += h.lookup_buffer_size;
+	lookup_data.reset();
+	lookup_data.append(ptr, h.lookup_data_size);
+	ptr += h.lookup_data_size;
+	lookup_shifts.assign((u8 const*)ptr, (u8 const*)ptr + h.lookup_shifts_size);
+	return true;
+}
+
+void Dist_cache::save(Buffer_view filename) {
+	join_lookups();
+	write_cache(filename);
+}
+
+void Dist_cache::write_cache(Buffer_view filename) {
+	assert(size >= facility_count);
+	Dist_cache_header h {};
+	h.magic = dist_cache_magic;
+	h.version = dist_cache_version;
+	h.graph_stamp = graph->cache_stamp;
+	h.facility_count = facility_count;
+	h.lookup_routes = lookup_routes;
+	h.lookup_buffer_size = lookup_buffer.size();
+	h.lookup_data_size = lookup_data.size();
+	h.lookup_shifts_size = lookup_shifts.size();
+
+	Buffer out;
+	out.emplace_back<Dist_cache_header>(h);
+	out.append(positions.data(), facility_count * sizeof(Graph_position));
+	for (int a = 0; a < facility_count; ++a) {
+		out.append(&m_dist(a, 0), facility_count * sizeof(u16));
 	}
+	out.append(lookup_buffer);
+	out.append(lookup_data);
+	out.append(lookup_shifts.data(), lookup_shifts.size());
+	write_file_replace(out, filename);
 }
 
+Dist_cache::~Dist_cache() {
+	join_lookups();
+}
 
-void Dist_cache::init(int facility_count_, Graph const* graph_) {
+void Dist_cache::init(int facility_count_, Graph const* graph_, bool lookup_routes_) {
+	join_lookups();
+	// the lookups stay valid as long as the graph and their layout do
+	if (graph != graph_ or lookup_routes != lookup_routes_) {
+		lookup_buffer.reset();
+		lookup_data.reset();
+		lookup_shifts.clear();
+	}
     facility_count = facility_count_;
     graph = graph_;
+	lookup_routes = lookup_routes_;
+    old_size = 0;
 
     size_max = facility_count + agents_per_team;
     buffer.resize(sizeof(u8) * 256 * 2 + sizeof(Graph_position) * size_max
@@ -876,12 +2558,14 @@ void Dist_cache::init(int facility_count_, Graph const* graph_) {
     for (auto& i: id_to_index1) { i = 0xff; }
     size = 0;
 
-	lookup_buffer.emplace_back<Lookups_t>();
-	lookup_buffer.get<Lookups_t>().init(&lookup_buffer);
+	if (lookup_buffer.size() == 0) {
+		lookup_buffer.emplace_back<Lookups_t>();
+		lookup_buffer.get<Lookups_t>().init(&lookup_buffer);
+	}
 }
     
 void Dist_cache::register_pos(u8 id, Pos pos) {
-    auto pos_g = graph->pos(pos);
+    auto pos_g = graph->pos_cached(pos);
     int index = positions.index(pos_g);
     if (index == -1 or index >= size) {
         index = size++;
@@ -891,30 +2575,140 @@ void Dist_cache::register_pos(u8 id, Pos pos) {
     narrow(id_to_index1[id], index);
 }
 
-void Dist_cache::calc_facilities() {
+void Dist_cache::calc_facilities(Buffer_view save_to) {
     assert(size == facility_count);
+	join_lookups();
+	if (size == 0) return;
+	lookup_save_to.reset();
+	if (save_to.size()) {
+		lookup_save_to.append(save_to);
+		lookup_save_to.append0();
+	}
+
+	// The tables are allocated up front, so that the workers can write into them while the lookups
+	// are hidden from get_lookup. Each sweep is one task, both of a facility may run concurrently.
+	// Facilities that already have tables from an earlier simulation on this map keep them.
+	std::vector<Graph_position> sources;
+	u32 first = lookup_buffer.get<Lookups_t>().size();
 	for (u8 i = 0; i < size; ++i) {
-		auto pos = positions[i];
-		add_lookup(pos);
+		if (get_lookup(positions[i]) != lookup_invalid) continue;
+		u32 l = register_lookup(positions[i]);
+		assert(l == first + sources.size());
+		sources.push_back(graph->to_internal(positions[i]));
+	}
+	int count = sources.size();
+	lookup_data.addsize(count * lookup_size());
+	lookup_shifts.resize(2 * (first + count));
+
+	// the matrix below counts as one more task, so that the file is only written once both are done
+	int sweeps = 2 * count;
+	if (sweeps) lookups_ready.store(false, std::memory_order_relaxed);
+	lookup_next_sweep.store(0, std::memory_order_relaxed);
+	lookup_sweeps_left.store(sweeps + 1, std::memory_order_relaxed);
+	int threads = std::min((int)std::max(std::thread::hardware_concurrency(), 1u), sweeps);
+	for (int i = 0; i < threads; ++i) {
+		lookup_workers.emplace_back([this, sources, first, sweeps]() {
+			Dist_heap heap;
+			std::vector<u32> scratch;
+			int sweep;
+			while ((sweep = lookup_next_sweep.fetch_add(1)) < sweeps) {
+				sweep_lookup(first + sweep / 2, sources[sweep / 2], sweep % 2, &heap, &scratch);
+				finish_lookup_task();
+			}
+		});
 	}
 
-    /*for (u8 a = 0; a < size; ++a) {
-        m_dist(a, a) = 0;
-        for (u8 b = a + 1; b < size; ++b) {
-            m_dist(a, b) = (u16)(graph->dist_road(positions[a], positions[b]) / 1000);
-            m_dist(b, a) = (u16)(graph->dist_road(positions[b], positions[a]) / 1000);
-        }
-        }*/
+	// meanwhile, the matrix is filled without the tables
+    calc_distances(0);
+	finish_lookup_task();
+}
+
+void Dist_cache::finish_lookup_task() {
+	if (lookup_sweeps_left.fetch_sub(1) != 1) return;
+	lookups_ready.store(true, std::memory_order_release);
+	// Only the rows and columns of the agents change from here on, and the lookups only grow
+	// through add_lookup, which waits for this
+	if (lookup_save_to.size()) write_cache(lookup_save_to.data());
 }
 
 void Dist_cache::calc_agents() {
-    /*for (u8 a = facility_count; a < size; ++a) {
-        m_dist(a, a) = 0;
-        for (u8 b = 0; b < a; ++b) {
-            m_dist(a, b) = (u16)(graph->dist_road(positions[a], positions[b]) / 1000);
-            m_dist(b, a) = (u16)(graph->dist_road(positions[b], positions[a]) / 1000);
+    // the old index of each agent position that was already there before the last reset
+    std::vector<int> old_index (size, -1);
+    std::vector<int> moved;
+    for (int a = facility_count; a < size; ++a) {
+        for (int o = facility_count; incremental and o < old_size; ++o) {
+            if (old_positions[o] == positions[a]) {
+                old_index[a] = o;
+                break;
+            }
         }
-        } */   
+        if (old_index[a] == -1) moved.push_back(a);
+    }
+
+    // take over their distances to the facilities and to each other
+    for (int a = facility_count; a < size; ++a) {
+        int oa = old_index[a];
+        if (oa == -1) continue;
+        for (int b = 0; b < size; ++b) {
+            int ob = b < facility_count ? b : old_index[b];
+            if (ob == -1) continue;
+            m_dist(a, b) = old_distances[oa * size_max + ob];
+            m_dist(b, a) = old_distances[ob * size_max + oa];
+        }
+    }
+    int total = size * size - facility_count * facility_count;
+    reused = 0;
+    for (int a = 0; a < size; ++a) {
+        for (int b = a < facility_count ? facility_count : 0; b < size; ++b) {
+            reused += m_dist(a, b) != 0xffff;
+        }
+    }
+    calc_distances(moved);
+    computed = total - reused;
+}
+
+void Dist_cache::calc_distances(int first) {
+    assert(0 <= first and first <= size);
+    std::vector<int> added;
+    for (int a = first; a < size; ++a) added.push_back(a);
+    calc_distances(added);
+}
+
+void Dist_cache::calc_distances(std::vector<int> const& added) {
+    if (added.empty()) return;
+    std::vector<bool> is_added (size);
+    std::vector<Graph_position> added_pos, rest_pos;
+    std::vector<int> rest;
+    for (int a: added) {
+        assert(0 <= a and a < size);
+        is_added[a] = true;
+        added_pos.push_back(positions[a]);
+    }
+    for (int a = 0; a < size; ++a) {
+        if (is_added[a]) continue;
+        rest.push_back(a);
+        rest_pos.push_back(positions[a]);
+    }
+    Array_view<Graph_position> all {positions.data(), size};
+    int nadded = added.size();
+    std::vector<u32> table (size * size);
+
+    // the rows of the new positions, then the rest of their columns
+    graph->dist_table({added_pos.data(), nadded}, all, table.data(), &workspace);
+    for (int i = 0; i < nadded; ++i) {
+        int a = added[i];
+        for (int b = 0; b < size; ++b) {
+            m_dist(a, b) = a == b ? 0 : to_km(table[i * size + b]);
+        }
+    }
+    if (rest.empty()) return;
+    graph->dist_table({rest_pos.data(), (int)rest.size()}, {added_pos.data(), nadded}, table.data(),
+        &workspace);
+    for (int i = 0; i < (int)rest.size(); ++i) {
+        for (int j = 0; j < nadded; ++j) {
+            m_dist(rest[i], added[j]) = to_km(table[i * nadded + j]);
+        }
+    }
 }
 
 
@@ -941,6 +2735,11 @@ void Dist_cache::calc_agents() {
     jdbg,0;*/
 
 void Dist_cache::reset() {
+    if (incremental) {
+        old_size = size;
+        old_positions.assign(positions.begin(), positions.begin() + size);
+        old_distances.assign(distances.begin(), distances.end());
+    }
     for (u8 a = 0; a < facility_count; ++a) {
         std::memset(
             distances.data() + a*size_max + facility_count,
@@ -971,23 +2770,25 @@ void Dist_cache::load_positions() {
 u16 Dist_cache::lookup(u8 a_id, u8 b_id) {
 	u8 a = id_to_index2[a_id];
 	u8 b = id_to_index2[b_id];
-	if (m_dist(a, b) == 0xffff) {
+	if (m_dist(a, b) == dist_unknown) {
 		u32 dist = 0xffffffff;
 		if (a == b) {
 			dist = 0;
 		} else {
 			auto s = positions[a], t = positions[b];
+			// the tables are indexed by the internal ids
+			auto si = graph->to_internal(s), ti = graph->to_internal(t);
 			u32 lid = lookup_invalid;
 
 			if ((lid = get_lookup(s)) != lookup_invalid) {
 				if (t.is_node()) {
-					dist = lookup_distf(lid)[t.id];
+					dist = lookup_distf(lid, ti.id);
 				} else {
-					auto const& edge = graph->edges()[t.id];
+					auto const& edge = graph->edges_hot()[ti.id];
 					if (edge.flags & 1) {
-						dist = lookup_distf(lid)[edge.nodea] + (u32)(t.get_edge_pos() * edge.dist);
+						dist = lookup_distf(lid, edge.nodea) + (u32)(t.get_edge_pos() * edge.dist);
 					} if (edge.flags & 2) {
-						u32 d = lookup_distf(lid)[edge.nodeb] + (u32)((1.f - t.get_edge_pos()) * edge.dist);
+						u32 d = lookup_distf(lid, edge.nodeb) + (u32)((1.f - t.get_edge_pos()) * edge.dist);
 						if (d < dist) {
 							dist = d;
 						}
@@ -995,13 +2796,13 @@ u16 Dist_cache::lookup(u8 a_id, u8 b_id) {
 				}
 			} else if ((lid = get_lookup(t)) != lookup_invalid) {
 				if (s.is_node()) {
-					dist = lookup_distb(lid)[s.id];
+					dist = lookup_distb(lid, si.id);
 				} else {
-					auto const& edge = graph->edges()[s.id];
+					auto const& edge = graph->edges_hot()[si.id];
 					if (edge.flags & 2) {
-						dist = lookup_distb(lid)[edge.nodea] + (u32)(s.get_edge_pos() * edge.dist);
+						dist = lookup_distb(lid, edge.nodea) + (u32)(s.get_edge_pos() * edge.dist);
 					} if (edge.flags & 1) {
-						u32 d = lookup_distb(lid)[edge.nodeb] + (u32)((1.f - s.get_edge_pos()) * edge.dist);
+						u32 d = lookup_distb(lid, edge.nodeb) + (u32)((1.f - s.get_edge_pos()) * edge.dist);
 						if (d < dist) {
 							dist = d;
 						}
@@ -1009,11 +2810,11 @@ u16 Dist_cache::lookup(u8 a_id, u8 b_id) {
 				}
 			}
 			if (lid == lookup_invalid) {
-				dist = graph->dist_road(positions[a], positions[b]);
+				dist = graph->dist_labels(positions[a], positions[b], &workspace);
 			}
 		}
 
-		m_dist(a, b) = (u16)(dist / 1000);
+		m_dist(a, b) = to_km(dist);
 	}
     return m_dist(a, b);
 }
@@ -1021,8 +2822,8 @@ u16 Dist_cache::lookup(u8 a_id, u8 b_id) {
 u16 Dist_cache::lookup_old(u8 a_id, u8 b_id) {
     u8 a = id_to_index1[a_id];
     u8 b = id_to_index1[b_id];
-    if (m_dist(a, b) == 0xffff) {
-        m_dist(a, b) = a == b ? 0 : (u16)(graph->dist_road(positions[a], positions[b]) / 1000);
+    if (m_dist(a, b) == dist_unknown) {
+        m_dist(a, b) = a == b ? 0 : to_km(graph->dist_labels(positions[a], positions[b], &workspace));
     }
     return m_dist(a, b);
 }
@@ -3,57 +3,90 @@
 #include "array.hpp"
 #include "flat_data.hpp"
 #include "objects.hpp"
+#include "system.hpp"
 
 namespace jup {
 
-struct Edge_iterator;
 struct Graph;
-struct Edge;
 
 constexpr u32 node_invalid = 0xffffffff;
 constexpr u32 edge_invalid = 0xffffffff;
 constexpr u32 dist_invalid = 0xffffffff;
 constexpr u32 lookup_invalid = 0xffffffff;
+constexpr u32 chain_invalid = 0xffffffff;
+// Set in the prev (or next) array of a search if the entry is the chain used to reach the node
+// instead of the preceding node. Check for node_invalid first.
+constexpr u32 prev_chain = 0x80000000;
+// Set in the references of the arcs of the contraction hierarchy that are shortcuts
+constexpr u32 ch_shortcut = 0x80000000;
 
-struct Edge_iterator: public std::iterator<Edge, std::forward_iterator_tag> {
-    Graph const* graph = nullptr;
-	u32 edge = edge_invalid;
-	bool is_nodea = false;
+struct Node {
+	u32 edge; // some edge of the node, edge_invalid if the node is not part of the graph
+	Pos pos;
+};
 
-    Edge_iterator() {}
-    Edge_iterator(Graph const* graph, u32 edge, bool is_nodea):
-        graph{graph}, edge{edge}, is_nodea{is_nodea} {}
-    
-    Edge const& operator*() const;
-	Edge const* operator->() const { return &**this; }
-	Edge_iterator& operator++();
+/**
+ * The part of an edge needed by the searches
+ */
+struct Edge_hot {
+	u32 nodea, nodeb, dist, flags;
+};
 
-    bool operator==(Edge_iterator const& other) const {
-        return edge == other.edge and is_nodea == other.is_nodea;
-    }
-	bool operator!=(Edge_iterator const& other) const {
-        return not (*this == other);
-    }
+/**
+ * The part of an edge only needed for positions and routes
+ */
+struct Edge_cold {
+	u32 geo; // offset of the encoded pillar points, they end where those of the next edge begin
+	u32 name;
 };
 
-struct Node_range {
-    Graph const* graph = nullptr;
-    u32 node = node_invalid;
-    u32 edge = edge_invalid;
-    
-	Edge_iterator begin() const;
-	Edge_iterator end() const;
+/**
+ * A complete edge, as assembled by Graph::edges()
+ */
+struct Edge {
+	u32 nodea, nodeb, dist, flags, geo, name;
 };
 
-struct Node {
+// Set in Arc::flags if the node whose adjacency array contains the arc is nodea of its edge
+constexpr u32 arc_from_nodea = 4;
+
+/**
+ * An entry of the adjacency arrays of a node. Only the arcs that may be travelled in the direction
+ * of the array are stored.
+ */
+struct Arc {
+	u32 node; // the other end
+	u32 dist;
 	u32 edge;
-	Pos pos;
+	u32 flags; // the flags of the edge, and arc_from_nodea
+};
 
-    Node_range const iter(Graph const& graph) const;
+/**
+ * An edge of the routing overlay, standing for a chain of edges whose inner nodes have exactly two
+ * neighbours each. The overlay consists of all the other nodes.
+ */
+struct Chain {
+	u32 nodea, nodeb;
+	u32 dist; // the sum over the edges
+	u32 flags; // 1 if the whole chain may be travelled from nodea to nodeb, 2 for the other way
+	u32 begin; // index of the first edge in the chain edges
 };
 
-struct Edge {
-	u32 nodea, nodeb, linka, linkb, dist, flags, geo, name;
+/**
+ * An arc of the contraction hierarchy standing for the path over first (from from to middle) and
+ * second (from middle to to). Arcs of the hierarchy refer either to a Chain or, with ch_shortcut
+ * set, to a Shortcut.
+ */
+struct Shortcut {
+	u32 from, middle, to;
+	u32 first, second;
+};
+
+/**
+ * An entry of a hub label: the distance from the labeled node to hub, or from hub to it
+ */
+struct Hub {
+	u32 node, dist;
 };
 
 struct u24 {
@@ -99,20 +132,255 @@ struct Graph_position {
 	}
 };
 
+/**
+ * Optional preprocessing done by Graph::init. These are part of the key of the graph cache.
+ */
+struct Graph_options {
+    // If set, only the strongly connected part of the road network inside the box (plus some
+    // padding) is kept. In degrees.
+    bool crop = false;
+    double crop_min_lat = 0.0;
+    double crop_max_lat = 0.0;
+    double crop_min_lon = 0.0;
+    double crop_max_lon = 0.0;
+
+    // If set, the nodes are renumbered so that nodes close to each other are also close in memory.
+    // Graph_position and routes keep using the ids from before.
+    enum Reorder: u8 {
+        REORDER_NONE, REORDER_HILBERT, REORDER_BFS
+    };
+    u8 reorder = REORDER_NONE;
+
+    // If not zero, hub labels are built for Graph::dist_labels. Building them is given up once they
+    // need more than that many megabytes or take more than hub_label_max_seconds.
+    u32 hub_label_max_mb = 0;
+    float hub_label_max_seconds = 30.f;
+
+    bool operator== (Graph_options const& o) const {
+        return crop == o.crop and (not crop or (crop_min_lat == o.crop_min_lat
+            and crop_max_lat == o.crop_max_lat and crop_min_lon == o.crop_min_lon
+            and crop_max_lon == o.crop_max_lon)) and reorder == o.reorder
+            and hub_label_max_mb == o.hub_label_max_mb
+            and (not hub_label_max_mb or hub_label_max_seconds == o.hub_label_max_seconds);
+    }
+    bool operator!= (Graph_options const& o) const { return not (*this == o); }
+};
+
+/**
+ * Counters of the work done by a search, for benchmarks
+ */
+struct Search_stats {
+	u64 settled = 0; // nodes taken from the queue
+	u64 arcs = 0; // arcs looked at
+	u64 edges = 0; // edges looked at, e.g. for the start and end position
+};
+
+/**
+ * Indexed 4-ary min-heap of nodes keyed by their distance, used as the queue of the searches. Keys
+ * can be decreased in place. The storage is kept between searches, so reusing one heap does not
+ * allocate after the first search on a graph.
+ */
+struct Dist_heap {
+	struct Item {
+		u32 dist, node;
+	};
+	static constexpr u32 const not_queued = 0xffffffff;
+
+	Array<Item> items;
+	Array<u32> index; // position of a node in items, or not_queued
+
+	/**
+	 * Empty the heap and make room for nodes with ids below nnodes
+	 */
+	void reset(u32 nnodes);
+
+	bool empty() const { return items.size() == 0; }
+	Item top() const { assert(not empty()); return items[0]; }
+	Item pop();
+
+	/**
+	 * Insert node with key dist, or decrease its key if it is already in the heap. The key must not
+	 * increase.
+	 */
+	void push(u32 node, u32 dist);
+
+	bool contains(u32 node) const { return index[node] != not_queued; }
+
+private:
+	void sift_up(int i, Item item);
+	void sift_down(int i, Item item);
+};
+
+/**
+ * The part of the chain a position lies on that can be reached from it without passing an overlay
+ * node, see chain_reach in graph.cpp.
+ */
+struct Chain_reach {
+	u32 chain; // chain_invalid if the position is not inside a chain
+	std::vector<u32> nodes; // the nodes of the chain from nodea to nodeb
+	std::vector<u32> dist; // the distance from the position to the nodes, or from them to it
+	int ia, ib; // the nodes next to the position towards nodea and nodeb, the same for a node
+};
+
+/**
+ * The memory used by the searches of the graph. Each thread should own one and pass it to all its
+ * searches; then starting a search neither allocates nor touches every node. The entries are
+ * stamped with the epoch they were written in, so reset only has to increment it.
+ */
+struct Search_workspace {
+	struct Entry {
+		u32 distf, distb; // distance from the start and to the end
+		u32 prev, next; // the arcs towards the start and the end
+		u32 epoch;
+	};
+	Array<Entry> entries;
+	u32 epoch = 0;
+	Dist_heap heapf, heapb;
+	Chain_reach reach_s, reach_t;
+
+	/**
+	 * Invalidate all entries and make room for nodes with ids below nnodes
+	 */
+	void reset(u32 nnodes);
+
+	/**
+	 * Returns the entry of node, clearing it first if it was written before the last reset
+	 */
+	Entry& operator[] (u32 node) {
+		Entry& e = entries[node];
+		if (e.epoch != epoch) e = { dist_invalid, dist_invalid, node_invalid, node_invalid, epoch };
+		return e;
+	}
+};
+
+/**
+ * Remembers the results of Graph::pos for recently snapped positions. Agents report the same
+ * position for many steps in a row, e.g. while charging or waiting at a facility, so most lookups
+ * hit. The table is direct-mapped with a fixed number of slots; a new position replaces the one
+ * in its slot.
+ */
+struct Pos_cache {
+	struct Entry {
+		Pos pos;
+		Graph_position result;
+		bool used;
+	};
+	static constexpr int const slot_bits = 12;
+
+	Array<Entry> entries; // allocated on first use
+	u64 hits = 0;
+	u64 misses = 0;
+
+	/**
+	 * Forget all positions and zero the counters
+	 */
+	void reset();
+
+	Entry& slot(Pos pos) {
+		if (entries.size() == 0) entries.assign_zero(1 << slot_bits);
+		u32 key = (u32)pos.lat << 16 | pos.lon;
+		return entries[(key * 2654435761u) >> (32 - slot_bits)];
+	}
+	float hit_rate() const { return hits + misses ? (float)hits / (float)(hits + misses) : 0.f; }
+};
+
 struct Graph {
     using Nodes_t = Flat_array<Node, u32, u32>;
-    using Edges_t = Flat_array<Edge, u32, u32>;
-	using Geometry_t = Flat_array<Pos, u8, u8>;
-	static constexpr int const geo_size = (sizeof(Geometry_t::Offset_t) + sizeof(Geometry_t::Size_t));
-	static_assert(sizeof(Geometry_t::Type) == 2 * geo_size, "Geometry offset mismatch");
+    using Edges_hot_t = Flat_array<Edge_hot, u32, u32>;
+    using Edges_cold_t = Flat_array<Edge_cold, u32, u32>;
+	using Geometry_t = Flat_array<u8, u32, u32>;
+	// The number of points of an edge is limited, including both of its nodes
+	static constexpr int const max_edge_points = 257;
 	using Route_t = Flat_array<u32, u16, u16>;
-
+	using Arc_index_t = Flat_array<u32, u32, u32>;
+	using Arcs_t = Flat_array<Arc, u32, u32>;
+	using Ids_t = Flat_array<u32, u32, u32>;
+	using Chains_t = Flat_array<Chain, u32, u32>;
+	using Shortcuts_t = Flat_array<Shortcut, u32, u32>;
+	using Landmark_dist_t = Flat_array<u32, u32, u32>;
+	using Hubs_t = Flat_array<Hub, u32, u32>;
+	using Lengths_t = Flat_array<float, u32, u32>;
+	using Coords_t = Flat_array<u16, u32, u32>;
+	// The number of landmarks, there may be fewer on small graphs
+	static constexpr int const landmark_count = 8;
 
     /**
      * Reads the GraphHopper graph from node_filename and edge_filename into this graph. May be
      * called multiple times to re-initialize the graph.
      */ 
-    void init(Buffer_view name, Buffer_view node_filename, Buffer_view edge_filename, Buffer_view geometry_filename);
+    void init(Buffer_view name, Buffer_view node_filename, Buffer_view edge_filename,
+        Buffer_view geometry_filename, Graph_options const& options = {});
+
+    /**
+     * Like init, but tries to map the finished graph from cache_filename first. The cache is only
+     * used if it was written by the same version of this code from source files with the same size
+     * and modification time. Otherwise the graph is read as usual and the cache is rewritten.
+     * Returns whether the cache was used.
+     */
+    bool init_cached(Buffer_view name, Buffer_view node_filename, Buffer_view edge_filename,
+        Buffer_view geometry_filename, Buffer_view cache_filename, Graph_options const& options = {});
+
+    /**
+     * Remove everything outside of the box given by options, then keep only the largest strongly
+     * connected component of the rest. Nodes and edges are renumbered compactly, invalidating any
+     * Graph_position.
+     */
+    void crop(Graph_options const& options);
+
+    /**
+     * Renumber the nodes by the order given by options.reorder, and the edges by their first node.
+     * Removed nodes and edges are dropped. Also sets up the tables for node_internal and friends.
+     */
+    void reorder(u8 order);
+
+    /**
+     * Move node i to new_id[i] and edge i to new_edge[i], dropping those mapped to node_invalid or
+     * edge_invalid. The edges of a node that is kept must be kept as well. The arcs of each node
+     * stay in the same order.
+     */
+    void renumber(u32 const* new_id, u32 new_nnodes, u32 const* new_edge, u32 new_nedges);
+
+    /**
+     * Build the routing overlay by collapsing each chain of nodes with two neighbours into a single
+     * Chain. Has to be called last, after crop and reorder.
+     */
+    void build_chains();
+
+    /**
+     * Completes the result of a search on the overlay. The inner nodes of each chain get the
+     * better distance over its ends, and prev entries that point to a chain (marked with
+     * prev_chain) are replaced by the preceding node on it. If reverse, dist and prev belong to a
+     * backward search, i.e. the distance to the target and the next node.
+     */
+    void chain_fill(u32* dist, u32* prev, bool reverse) const;
+
+    /**
+     * Build the contraction hierarchy on top of the overlay, which dist_road uses. Has to be
+     * called after build_chains.
+     */
+    void build_hierarchy();
+
+    /**
+     * Select landmarks on the overlay that are far apart from each other, and store the distances
+     * from and to each of them for every overlay node. dist_road derives lower bounds from them,
+     * see landmark_bound. Has to be called after build_chains.
+     */
+    void build_landmarks();
+
+    /**
+     * Derive hub labels from the contraction hierarchy, going from the top of the hierarchy down.
+     * The forward label of a node lists the nodes its upward search reaches with their distances,
+     * the backward label those of the downward search. Entries that are not shortest distances are
+     * pruned using the labels already built. Gives up, leaving the graph without labels, when the
+     * limits in options are exceeded. Has to be called after build_hierarchy.
+     */
+    void build_hub_labels();
+
+    /**
+     * Build the index used by pos: a uniform grid over the nodes that have edges, and the list of
+     * edges at each node. Also measures the edges for edge_lengths.
+     */
+    void build_pos_index();
 
     /**
      * Converts a lat, lon pair into a Pos
@@ -124,17 +392,56 @@ struct Graph {
 	 */
 	float dist_air(Pos const a, Pos const b) const;
 
+	/**
+	 * Writes the distance from a to each of the n positions given by lat and lon into out. Uses
+	 * AVX2 or SSE2 if the processor has them, the results match those of dist_air within float
+	 * rounding.
+	 */
+	void dist_air_batch(Pos const a, u16 const* lat, u16 const* lon, int n, float* out) const;
+
 	/**
 	 * Returns the nearest node or edge
 	 */
 	Graph_position pos(Pos const pos) const;
 
 	/**
-	 * Returns the distance of the shortest route between two positions
-	 * Optionally writes that route into a buffer
+	 * Writes the count nodes nearest to pos that have edges into best, with their distance, sorted
+	 * by distance and then by id. The ids are internal, missing nodes are node_invalid. Searches
+	 * the cells of the grid around pos, see build_pos_index.
 	 */
-	u32 dist_road(Graph_position const s, Graph_position const t, Buffer* into = nullptr) const;
-    
+	void nearest_nodes(Pos const pos, std::pair<float, u32>* best, int count) const;
+
+	/**
+	 * Like pos, but looks into pos_cache first. The cache lives as long as the graph and is
+	 * cleared when the graph is re-initialized. It is not synchronized, so only one thread may
+	 * call this at a time.
+	 */
+	Graph_position pos_cached(Pos const pos) const;
+
+	/**
+	 * Returns the distance of the shortest route between two positions, using a bidirectional search
+	 * on the contraction hierarchy. Optionally writes that route into a buffer, and counts the work
+	 * done into stats. The search runs in workspace, or in one owned by the calling thread.
+	 */
+	u32 dist_road(Graph_position const s, Graph_position const t, Buffer* into = nullptr,
+		Search_stats* stats = nullptr, Search_workspace* workspace = nullptr) const;
+
+	/**
+	 * Computes the distances from each of sources to each of targets, the same as dist_road, and
+	 * writes them into out, one row of targets.size() values per source. Needs only one search in
+	 * the hierarchy per position: the searches of the targets leave their distances in buckets at
+	 * the nodes they reach, where the searches of the sources pick them up.
+	 */
+	void dist_table(Array_view<Graph_position> sources, Array_view<Graph_position> targets,
+		u32* out, Search_workspace* workspace = nullptr) const;
+
+	/**
+	 * Returns the same distance as dist_road, but without the route. Uses the hub labels if they
+	 * were built, else dist_road.
+	 */
+	u32 dist_labels(Graph_position const s, Graph_position const t,
+		Search_workspace* workspace = nullptr) const;
+
 	struct {
 		Graph const* g;
 		u32 operator*(std::pair<Graph_position, Graph_position> arg) {
@@ -147,10 +454,194 @@ struct Graph {
      */
     std::pair<double, double> get_pos_back(Pos pos) const;
 
-    Buffer_view const name() const { return {m_data.data() + name_offset, name_size}; }
-    auto const& nodes() const { return m_data.get<Nodes_t>(node_offset); }
-	auto const& edges() const { return m_data.get<Edges_t>(edge_offset); }
-	auto const& geometry(u32 ofs) const { return m_data.get<Geometry_t>(geometry_offset + geo_size * ofs); }
+    /**
+     * The memory containing the graph, either m_data or the mapped cache file.
+     */
+    Buffer_view data() const { return m_mapped ? m_mapped : Buffer_view {m_data}; }
+    template <typename T>
+    T const& get(int offset) const {
+        assert(data().inside((T const*)(data().data() + offset)));
+        return *(T const*)(data().data() + offset);
+    }
+
+    Buffer_view const name() const { return {data().data() + name_offset, name_size}; }
+    auto const& nodes() const { return get<Nodes_t>(node_offset); }
+    auto const& edges_hot() const { return get<Edges_hot_t>(edge_hot_offset); }
+    auto const& edges_cold() const { return get<Edges_cold_t>(edge_cold_offset); }
+
+    /**
+     * Compatibility view of the edges, each Edge is assembled from its hot and cold part. Code that
+     * only needs one of them should use edges_hot() or edges_cold() instead.
+     */
+    struct Edges_view {
+        Graph const* graph;
+        u32 size() const { return graph->edges_hot().size(); }
+        Edge operator[] (u32 edge) const {
+            auto const& h = graph->edges_hot()[edge];
+            auto const& c = graph->edges_cold()[edge];
+            return { h.nodea, h.nodeb, h.dist, h.flags, c.geo, c.name };
+        }
+    };
+    Edges_view edges() const { return {this}; }
+
+    /**
+     * Graph_position and routes use the ids the nodes and edges had before they were reordered,
+     * everything else uses the internal ids. These translate between the two.
+     */
+    u32 node_internal(u32 id) const { return translate(node_internal_offset, id); }
+    u32 node_external(u32 id) const { return translate(node_external_offset, id); }
+    u32 edge_internal(u32 id) const { return translate(edge_internal_offset, id); }
+    u32 edge_external(u32 id) const { return translate(edge_external_offset, id); }
+    u32 translate(int ids_offset, u32 id) const {
+        return ids_offset == -1 ? id : get<Ids_t>(ids_offset)[id];
+    }
+    Graph_position to_internal(Graph_position pos) const {
+        return pos.is_node() ? Graph_position {node_internal(pos.id)}
+            : Graph_position {edge_internal(pos.id), pos.edge_pos};
+    }
+    Graph_position to_external(Graph_position pos) const {
+        return pos.is_node() ? Graph_position {node_external(pos.id)}
+            : Graph_position {edge_external(pos.id), pos.edge_pos};
+    }
+
+    /**
+     * The encoded pillar points of the edge. Each point is stored as the difference to the point
+     * before it (starting with nodea), one zigzag varint for lat and one for lon.
+     */
+    Buffer_view geometry(u32 edge) const {
+        auto const& geo = get<Geometry_t>(geometry_offset);
+        u32 begin = edges_cold()[edge].geo;
+        u32 end = edge + 1 < edges_cold().size() ? edges_cold()[edge + 1].geo : geo.size();
+        return {geo.begin() + begin, (int)(end - begin)};
+    }
+
+    /**
+     * Decodes the points of the edge into out, from nodea over the pillar points to nodeb, and
+     * returns their number. out must have space for max_edge_points.
+     */
+    int edge_points(u32 edge, Pos* out) const;
+
+    /**
+     * Decodes only the points i - 1 and i of the edge, numbered as by edge_points, into a and b
+     */
+    void edge_segment(u32 edge, int i, Pos* a, Pos* b) const;
+
+    /**
+     * The distance along the edge from nodea to each of its points after nodea, as given by
+     * dist_air; the last one is the length of the edge. Empty for removed edges.
+     */
+    Array_view<float> edge_lengths(u32 edge) const {
+        auto const& index = get<Arc_index_t>(edge_length_index_offset);
+        return {get<Lengths_t>(edge_length_offset).begin() + index[edge], (int)(index[edge + 1] - index[edge])};
+    }
+
+    /**
+     * The arcs that may be used to leave (arcs_out) or to reach (arcs_in) the node. For arcs_in,
+     * Arc::node is the node the arc starts at.
+     */
+    Array_view<Arc> arcs_out(u32 node) const { return arcs(arc_out_index_offset, arc_out_offset, node); }
+    Array_view<Arc> arcs_in (u32 node) const { return arcs(arc_in_index_offset,  arc_in_offset,  node); }
+    Array_view<Arc> arcs(int index_offset, int arcs_offset, u32 node) const {
+        auto const& index = get<Arc_index_t>(index_offset);
+        return {get<Arcs_t>(arcs_offset).begin() + index[node], (int)(index[node + 1] - index[node])};
+    }
+
+    /**
+     * The routing overlay, see build_chains. Nodes in the overlay have the arcs along their chains,
+     * with Arc::edge being the chain. The inner nodes of chains have no such arcs, node_chain
+     * returns their chain (and chain_invalid for nodes of the overlay).
+     */
+    auto const& chains() const { return get<Chains_t>(chain_offset); }
+    u32 node_chain(u32 node) const { return get<Ids_t>(node_chain_offset)[node]; }
+    bool in_overlay(u32 node) const { return node_chain(node) == chain_invalid; }
+    Array_view<Arc> chain_arcs_out(u32 node) const { return arcs(chain_out_index_offset, chain_out_offset, node); }
+    Array_view<Arc> chain_arcs_in (u32 node) const { return arcs(chain_in_index_offset,  chain_in_offset,  node); }
+
+    /**
+     * The edges of the chain, in order from nodea to nodeb
+     */
+    Array_view<u32> chain_edges(u32 chain) const {
+        auto const& edges = get<Ids_t>(chain_edges_offset);
+        u32 begin = chains()[chain].begin;
+        u32 end = chain + 1 < chains().size() ? chains()[chain + 1].begin : edges.size();
+        return {edges.begin() + begin, (int)(end - begin)};
+    }
+
+    /**
+     * Calls fn with each inner node of the chain, walking from its end node to the other end.
+     */
+    template <typename Fn>
+    void chain_walk(u32 chain, u32 node, Fn const& fn) const {
+        auto edges = chain_edges(chain);
+        bool backwards = node != chains()[chain].nodea;
+        for (int i = 0; i + 1 < edges.size(); ++i) {
+            auto const& e = edges_hot()[edges[backwards ? edges.size() - 1 - i : i]];
+            node = e.nodea == node ? e.nodeb : e.nodea;
+            fn(node);
+        }
+    }
+
+    /**
+     * The arcs the searches expand: those of the overlay for its nodes, the usual ones for the
+     * inner nodes of chains. That way a search only walks along the chains of its start and end.
+     */
+    Array_view<Arc> search_arcs_out(u32 node) const { return in_overlay(node) ? chain_arcs_out(node) : arcs_out(node); }
+    Array_view<Arc> search_arcs_in (u32 node) const { return in_overlay(node) ? chain_arcs_in (node) : arcs_in (node); }
+
+    /**
+     * The contraction hierarchy, see build_hierarchy. ch_arcs_up are the arcs leaving the node
+     * towards nodes contracted later, ch_arcs_down the arcs reaching the node from those (Arc::node
+     * is where they start). Arc::edge refers to a chain or a shortcut, Arc::flags is unused.
+     */
+    auto const& shortcuts() const { return get<Shortcuts_t>(shortcut_offset); }
+    Array_view<Arc> ch_arcs_up  (u32 node) const { return arcs(ch_up_index_offset,   ch_up_offset,   node); }
+    Array_view<Arc> ch_arcs_down(u32 node) const { return arcs(ch_down_index_offset, ch_down_offset, node); }
+
+    /**
+     * The distances from each landmark to node, followed by those from node to each landmark.
+     * Unused landmarks and unreachable nodes have dist_invalid.
+     */
+    Array_view<u32> landmark_dist(u32 node) const {
+        return {get<Landmark_dist_t>(landmark_offset).begin() + 2 * landmark_count * node, 2 * landmark_count};
+    }
+
+    /**
+     * Returns a lower bound on the distance from overlay node a to overlay node b, using the
+     * triangle inequality with each landmark.
+     */
+    u32 landmark_bound(u32 a, u32 b) const;
+
+    /**
+     * The index of pos, see build_pos_index. The cells of the grid are 2^pos_grid_shift units of Pos
+     * wide, the first one starts at pos_grid_min. node_edges lists the edges of a node by their id.
+     * The positions of the nodes in the cells are also stored apart from the nodes, as one array of
+     * lat and one of lon parallel to the ids, so that they can be passed to dist_air_batch.
+     */
+    Array_view<u32> pos_grid_cell(int row, int col) const {
+        return ids(pos_grid_index_offset, pos_grid_offset, row * pos_grid_cols + col);
+    }
+    Array_view<u32> node_edges(u32 node) const { return ids(node_edges_index_offset, node_edges_offset, node); }
+    Array_view<u32> ids(int index_offset, int ids_offset, u32 i) const {
+        auto const& index = get<Arc_index_t>(index_offset);
+        return {get<Ids_t>(ids_offset).begin() + index[i], (int)(index[i + 1] - index[i])};
+    }
+
+    /**
+     * The hub labels, see build_hub_labels. They are sorted by the id of the hub. hub_dist returns
+     * the distance between two overlay nodes by merging their labels.
+     */
+    bool has_hub_labels() const { return hub_out_offset != -1; }
+    Array_view<Hub> hubs_out(u32 node) const { return hubs(hub_out_index_offset, hub_out_offset, node); }
+    Array_view<Hub> hubs_in (u32 node) const { return hubs(hub_in_index_offset,  hub_in_offset,  node); }
+    u32 hub_dist(u32 a, u32 b) const;
+    // The number of entries of all labels together
+    u64 hub_label_size() const {
+        return get<Hubs_t>(hub_out_offset).size() + get<Hubs_t>(hub_in_offset).size();
+    }
+    Array_view<Hub> hubs(int index_offset, int hubs_offset, u32 node) const {
+        auto const& index = get<Arc_index_t>(index_offset);
+        return {get<Hubs_t>(hubs_offset).begin() + index[node], (int)(index[node + 1] - index[node])};
+    }
 
     double map_min_lat = 0.0;
     double map_max_lat = 0.0;
@@ -159,14 +650,62 @@ struct Graph {
     float map_scale_lat = 0.f;
     float map_scale_lon = 0.f;
 
+    Graph_options options;
     Buffer m_data;
+    Mapped_file m_file;
+    Buffer_view m_mapped;
 
     int node_offset = -1;
-    int edge_offset = -1;
+    int edge_hot_offset = -1;
+    int edge_cold_offset = -1;
 	int geometry_offset = -1;
 	int name_offset = -1;
+	int arc_out_index_offset = -1;
+	int arc_out_offset = -1;
+	int arc_in_index_offset = -1;
+	int arc_in_offset = -1;
+	int node_internal_offset = -1;
+	int node_external_offset = -1;
+	int edge_internal_offset = -1;
+	int edge_external_offset = -1;
+	int chain_offset = -1;
+	int chain_edges_offset = -1;
+	int node_chain_offset = -1;
+	int chain_out_index_offset = -1;
+	int chain_out_offset = -1;
+	int chain_in_index_offset = -1;
+	int chain_in_offset = -1;
+	int shortcut_offset = -1;
+	int ch_up_index_offset = -1;
+	int ch_up_offset = -1;
+	int ch_down_index_offset = -1;
+	int ch_down_offset = -1;
+	int landmark_offset = -1;
+	int hub_out_index_offset = -1;
+	int hub_out_offset = -1;
+	int hub_in_index_offset = -1;
+	int hub_in_offset = -1;
+	int pos_grid_index_offset = -1;
+	int pos_grid_offset = -1;
+	int pos_grid_lat_offset = -1;
+	int pos_grid_lon_offset = -1;
+	int node_edges_index_offset = -1;
+	int node_edges_offset = -1;
+	int edge_length_index_offset = -1;
+	int edge_length_offset = -1;
+	Pos pos_grid_min = {0, 0};
+	int pos_grid_shift = 0;
+	int pos_grid_rows = 0;
+	int pos_grid_cols = 0;
 
 	int name_size = 0;
+
+	// Set by init_cached: the cache file (zero-terminated, empty if there is none) and a hash of
+	// the sources and options the graph was built from
+	Buffer cache_path;
+	u32 cache_stamp = 0;
+
+	mutable Pos_cache pos_cache;
 };
 
 struct Dist_cache {
@@ -182,10 +721,48 @@ struct Dist_cache {
     int facility_count = 0;
     Graph const* graph = nullptr;
 
-    void init(int facility_count, Graph const* graph);
+    // The distances are stored in km. A pair that has not been computed yet is dist_unknown, one
+    // without a route (or one further than that) saturates to dist_unreachable.
+    static constexpr u16 dist_unknown = 0xffff;
+    static constexpr u16 dist_unreachable = 0xfffe;
+    static u16 to_km(u32 dist) { return (u16)std::min(dist / 1000, (u32)dist_unreachable); }
+
+    // If set, reset remembers the agent positions and their distances, so that calc_agents only
+    // has to search for the agents whose Graph_position changed
+    bool incremental = true;
+    int old_size = 0;
+    std::vector<Graph_position> old_positions;
+    std::vector<u16> old_distances;
+    // The entries of the agent rows and columns the last calc_agents took over or computed
+    int reused = 0;
+    int computed = 0;
+
+    ~Dist_cache();
+
+    // The lookups only keep their routes (lookup_prev, lookup_next) if lookup_routes is set
+    void init(int facility_count, Graph const* graph, bool lookup_routes = false);
     void register_pos(u8 id, Pos pos);
-    void calc_facilities();
+    // Start building the lookups of all facilities in the background, then fill their distances.
+    // Once both are done, they are written to save_to, if given, as by save.
+    void calc_facilities(Buffer_view save_to = {});
+    // Fill the distances of the agents, reusing those of the last step for agents that stayed
     void calc_agents();
+    // Fill the distances between the positions from first on and all others in one batch
+    void calc_distances(int first);
+    // The same for the positions with the indices in added
+    void calc_distances(std::vector<int> const& added);
+
+    // The file to keep the facilities in (zero-terminated), next to the cache of the graph. Named
+    // after a hash of the positions of the facilities, so each layout of a map gets its own.
+    // Returns false if the graph was not cached.
+    bool cache_filename(Buffer* out) const;
+    // Read the distances between the facilities and the lookups from filename, if it was written
+    // for the same graph, facilities and lookup layout. Returns whether it was used.
+    bool load(Buffer_view filename);
+    // Write them, waiting for the lookups of calc_facilities
+    void save(Buffer_view filename);
+    // Like save, without waiting
+    void write_cache(Buffer_view filename);
     void reset();
     void move_to(u8 id, u8 to_id);
 
@@ -199,15 +776,61 @@ struct Dist_cache {
     u16 lookup(u8 a_id, u8 b_id);
     u16 lookup_old(u8 a_id, u8 b_id);
 
-	void add_lookup(Graph_position pos);
+	// Runs the searches in workspace, or in the one of this cache
+	void add_lookup(Graph_position pos, Search_workspace* workspace = nullptr);
+	// Returns lookup_invalid while the lookups of calc_facilities are being built
 	u32 get_lookup(Graph_position pos) const;
-	auto const* lookup_distf(u32 n) const { return (u32 const*)lookup_data.data() + (4 * n + 0) * graph->nodes().size(); }
-	auto const* lookup_prev(u32 n) const { return (u32 const*)lookup_data.data() + (4 * n + 1) * graph->nodes().size(); }
-	auto const* lookup_distb(u32 n) const { return (u32 const*)lookup_data.data() + (4 * n + 2) * graph->nodes().size(); }
-	auto const* lookup_next(u32 n) const { return (u32 const*)lookup_data.data() + (4 * n + 3) * graph->nodes().size(); }
+	// Add pos to the sorted list of lookups and return the index of its tables
+	u32 register_lookup(Graph_position pos);
+	// Fill the forward or the backward tables of lookup l for pos, given by internal ids. Compact
+	// lookups are searched in scratch first.
+	void sweep_lookup(u32 l, Graph_position pos, bool backward, Dist_heap* heap,
+		std::vector<u32>* scratch);
+	// Wait for the workers started by calc_facilities
+	void join_lookups();
+	// Called after each task of calc_facilities, the last one marks the lookups as ready
+	void finish_lookup_task();
+
+	// Find the distance to the nearest of the charging stations, which have to be registered
+	// facilities, for every node and every facility, with one backward search from all of them
+	void calc_charging(Array_view<u8> station_ids);
+	// The distance from facility id to the nearest charging station in km. Saturates at
+	// dist_unreachable, which also means that no station can be reached, so adding to it cannot
+	// wrap around.
+	u16 charging_km(u8 id) const {
+		assert(id_to_index2[id] < facility_count);
+		return facility_charging[id_to_index2[id]];
+	}
+	// The bytes of lookup_data used by one lookup
+	int lookup_size() const { return (lookup_routes ? 4 * sizeof(u32) : 2 * sizeof(u16)) * graph->nodes().size(); }
+	// The tables are indexed by the internal node ids, see Graph::node_internal. Without routes,
+	// the lookups are compact: they store the distances as u16 in units of 2^lookup_shifts meters,
+	// rounded down, which is exact for maps less than 65km across.
+	u32 lookup_distf(u32 l, u32 node) const { return lookup_dist(l, false, node); }
+	u32 lookup_distb(u32 l, u32 node) const { return lookup_dist(l, true,  node); }
+	u32 lookup_dist(u32 l, bool backward, u32 node) const {
+		u32 nnodes = graph->nodes().size();
+		if (lookup_routes) return ((u32 const*)lookup_data.data())[(4 * l + 2 * backward) * nnodes + node];
+		u16 d = ((u16 const*)lookup_data.data())[(2 * l + backward) * nnodes + node];
+		return d == 0xffff ? dist_invalid : (u32)d << lookup_shifts[2 * l + backward];
+	}
+	auto const* lookup_prev(u32 l) const { assert(lookup_routes); return (u32 const*)lookup_data.data() + (4 * l + 1) * graph->nodes().size(); }
+	auto const* lookup_next(u32 l) const { assert(lookup_routes); return (u32 const*)lookup_data.data() + (4 * l + 3) * graph->nodes().size(); }
 
 	Buffer lookup_buffer;
 	Buffer lookup_data;
+	bool lookup_routes = false;
+	std::vector<u8> lookup_shifts; // of the forward and the backward table of each compact lookup
+	std::vector<u32> lookup_scratch;
+	std::vector<u32> charging_dist; // by internal node id
+	std::vector<u16> facility_charging; // by index, in km
+	Search_workspace workspace;
+
+	std::vector<std::thread> lookup_workers;
+	std::atomic<int> lookup_next_sweep {0};
+	std::atomic<int> lookup_sweeps_left {0}; // and the matrix of calc_facilities
+	Buffer lookup_save_to; // zero-terminated, empty if calc_facilities does not save
+	std::atomic<bool> lookups_ready {true};
 };
 
 } /* end of namespace jup */
@@ -28,6 +28,15 @@ void print_usage(c_str argv0) {
 		<< "en the server and the program are dumped into a file.\n\n"
         << " " << MASSIM_QUIET << "  The output of the internal MASSim is not printed to the "
         << "console.\n"
+        << " " << PRELOAD_MAPS << "  Load all maps in the background right away, instead of loadin"
+        << "g each map when a simulation on it starts.\n"
+        << " " << NO_CROP << "  Keep the whole road network of each map, instead of only the part "
+        << "inside the area of the matches in the configuration.\n"
+        << " " << REORDER_NODES << " [order]  Renumber the nodes of each map so that close nodes "
+        << "are close in memory. The order is one of none (the default), hilbert or bfs.\n"
+        << " " << HUB_LABELS << " [megabytes] [seconds]  Build hub labels for each map, which answ"
+        << "er distance queries faster. Building them is given up if they need more memory or tim"
+        << "e than that.\n"
 		<< " " << ADD_AGENT << " [name] [password]  The login credentials for an agent. This opti"
 		<< "on may be specified multiple times. It also may use the % symbol at the end of a name,"
 		<< "which will be replaced by the numbers 1 to " << agents_per_team << ". For compatibilit"
@@ -44,7 +53,8 @@ void print_usage(c_str argv0) {
 		<< "s it to be ignored, or has the following form:\n   option arg1 [arg2]\n\n "
         << LAMPE_SHIP << " [ship]  Specifies the type of operation. Must be one of:\n    test  To "
         << "run a quick self-check\n    stats  To collect statistical information about simulation"
-        << "s and append them to the specified file\n\n";
+        << "s and append them to the specified file\n    bench  To measure the time needed to load"
+        << " each map of the MASSim installation and to run queries on it\n\n";
 }
 
 /**
@@ -93,6 +103,41 @@ bool parse_cmdline(int argc, c_str const* argv, Server_options* into, bool no_re
             }
         } else if (arg == MASSIM_QUIET) {
             into->massim_quiet = true;
+        } else if (arg == PRELOAD_MAPS) {
+            into->preload_maps = true;
+        } else if (arg == NO_CROP) {
+            into->crop_maps = false;
+        } else if (arg == REORDER_NODES) {
+            Buffer_view tmp;
+            if (not pop(&tmp)) {
+                return false;
+            }
+            if (tmp == "none") {
+                into->reorder_nodes = Graph_options::REORDER_NONE;
+            } else if (tmp == "hilbert") {
+                into->reorder_nodes = Graph_options::REORDER_HILBERT;
+            } else if (tmp == "bfs") {
+                into->reorder_nodes = Graph_options::REORDER_BFS;
+            } else {
+                jerr << "Error: unknown node order '" << tmp << "', must be one of none, hilbert or bfs\n";
+                return false;
+            }
+        } else if (arg == HUB_LABELS) {
+            Buffer_view max_mb, max_seconds;
+            if (not pop(&max_mb) or not pop(&max_seconds)) {
+                return false;
+            }
+            char* end_mb;
+            char* end_seconds;
+            long mb = std::strtol(max_mb.c_str(), &end_mb, 10);
+            float seconds = std::strtof(max_seconds.c_str(), &end_seconds);
+            if (*end_mb or *end_seconds or mb <= 0 or seconds <= 0.f) {
+                jerr << "Error: " << HUB_LABELS << " expects a positive number of megabytes and of"
+                     << " seconds\n";
+                return false;
+            }
+            into->hub_label_max_mb = mb;
+            into->hub_label_max_seconds = seconds;
         } else if (arg == STATS_FILE) {
             if (not pop(&into->statistics_file)) {
                 return false;
@@ -112,9 +157,12 @@ bool parse_cmdline(int argc, c_str const* argv, Server_options* into, bool no_re
 				into->ship = Server_options::SHIP_STATS;
 			} else if (tmp == LAMPE_SHIP_PLAY) {
 				into->ship = Server_options::SHIP_PLAY;
+			} else if (tmp == LAMPE_SHIP_BENCH) {
+				into->ship = Server_options::SHIP_BENCH;
 			} else {
 				jerr << "Error: unknown ship '" << tmp << "', must be one of " << LAMPE_SHIP_TEST
-                     << ", " << LAMPE_SHIP_STATS << " or " << LAMPE_SHIP_PLAY << '\n';
+                     << ", " << LAMPE_SHIP_STATS << ", " << LAMPE_SHIP_PLAY << " or "
+                     << LAMPE_SHIP_BENCH << '\n';
 				return false;
             }
         } else if (arg == ADD_AGENT or arg == ADD_DUMMY) {
@@ -198,7 +246,13 @@ bool parse_cmdline(int argc, c_str const* argv, Server_options* into, bool no_re
 								state = 4;
 							} else if (std::strcmp(args.back(), ADD_DUMMY) == 0 and state == 0) {
 								state = 4;
+							} else if (std::strcmp(args.back(), HUB_LABELS) == 0 and state == 0) {
+								state = 4;
 							} else if (std::strcmp(args.back(), MASSIM_QUIET) == 0) {
+                                state = 0;
+							} else if (std::strcmp(args.back(), PRELOAD_MAPS) == 0) {
+                                state = 0;
+							} else if (std::strcmp(args.back(), NO_CROP) == 0) {
                                 state = 0;
                             } else {
 								state = 1;
@@ -268,7 +322,12 @@ int main(int argc, c_str const* argv) {
 
     Socket_context socket_context;
     
-	if (options.ship == Server_options::SHIP_TEST) {
+	if (options.ship == Server_options::SHIP_BENCH) {
+		bench_graph_load(options.massim_loc);
+		bench_dist_road(options.massim_loc);
+		bench_queue(options.massim_loc);
+		bench_dist_air(options.massim_loc);
+	} else if (options.ship == Server_options::SHIP_TEST) {
 		while (true) try {
 			auto server_wrapper = std::make_unique<Server>(options);
 			server = server_wrapper.get();
@@ -20,18 +20,23 @@ constexpr auto LOAD_CFGFILE = "--load";
 constexpr auto LAMPE_SHIP = "-s";
 constexpr auto MASSIM_QUIET = "-q";
 constexpr auto STATS_FILE = "--stats";
+constexpr auto PRELOAD_MAPS = "--preload-maps";
+constexpr auto NO_CROP = "--no-crop";
+constexpr auto REORDER_NODES = "--reorder-nodes";
+constexpr auto HUB_LABELS = "--hub-labels";
 
 constexpr auto LAMPE_SHIP_TEST = "test";
 constexpr auto LAMPE_SHIP_TEST2 = "test2";
 constexpr auto LAMPE_SHIP_STATS = "stats";
 constexpr auto LAMPE_SHIP_PLAY = "play";
 constexpr auto LAMPE_SHIP_DUMMY = "dummy";
+constexpr auto LAMPE_SHIP_BENCH = "bench";
     
 }
 
 struct Server_options {
     enum Ship: u8 {
-        SHIP_TEST, SHIP_TEST2, SHIP_STATS, SHIP_PLAY, SHIP_DUMMY
+        SHIP_TEST, SHIP_TEST2, SHIP_STATS, SHIP_PLAY, SHIP_DUMMY, SHIP_BENCH
     };
     struct Agent_option {
         Buffer_view name, password;
@@ -49,6 +54,11 @@ struct Server_options {
 	Buffer_view statistics_file;
     Buffer _string_storage;
     bool massim_quiet = false;
+    bool preload_maps = false;
+    bool crop_maps = true;
+    u8 reorder_nodes = Graph_options::REORDER_NONE;
+    u32 hub_label_max_mb = 0;
+    float hub_label_max_seconds = 30.f;
 
     bool check_valid();
 };
@@ -66,6 +76,23 @@ struct Mothership {
 // The maximum number of maps
 constexpr int max_map_number = 5;
 
+/**
+ * Append the names of all map directories in the MASSim installation at massim_loc to names, each
+ * including the terminating zero. Returns whether the graphs directory could be read.
+ */
+bool list_maps(Buffer_view massim_loc, Buffer* names);
+
+/**
+ * Append the zero-terminated path of the file inside the directory of the map to into.
+ */
+void append_map_path(Buffer_view massim_loc, c_str map, c_str file, Buffer* into);
+
+/**
+ * Scan the MASSim configuration at config_path for the matches played on map and set the cropping
+ * box of options to the union of their bounds. Returns whether any such match was found.
+ */
+bool read_map_bounds(Buffer_view config_path, c_str map, Graph_options* options);
+
 class Server {
     struct Agent_data {
         Socket socket;
@@ -82,8 +109,19 @@ public:
     Server(Server_options const& op);
     ~Server();
 
+    /**
+     * Find the maps of the MASSim installation. They are only loaded on first use by get_map, unless
+     * options.preload_maps is set; then they are loaded in the background right away, concurrently
+     * on one thread per core.
+     */
     bool load_maps();
 
+    /**
+     * Return the graph of the map with the specified name, loading it first if necessary. Waits if
+     * the map is currently being loaded in the background. Returns nullptr if there is no such map.
+     */
+    Graph* get_map(Buffer_view name);
+
     void register_mothership(Mothership* mothership);
     bool register_agent(Server_options::Agent_option const& agent);
     void run_simulation();
@@ -92,22 +130,39 @@ public:
         return agent_buffer.get<Flat_array<Agent_data>>();
     }
 
-    auto& graph(int i) {
-        assert(0 <= i and i < (int)graphs.size());
-        return graphs[i];
-    }
-    auto const& graph(int i) const {
-        assert(0 <= i and i < (int)graphs.size());
-        return graphs[i];
-    }
-
 private:
+    struct Map_entry {
+        enum State: u8 {
+            UNLOADED, LOADING, LOADED
+        };
+        
+        Buffer name; // zero-terminated
+        Graph_options graph_options;
+        std::unique_ptr<Graph> graph;
+        u8 state = UNLOADED;
+    };
+
+    /**
+     * Load the map, which must have been put into the LOADING state by the caller. Does not hold
+     * maps_mutex while loading.
+     */
+    void load_map(Map_entry* map);
+    void preload_maps();
+    
     Buffer agent_buffer;
     Buffer general_buffer;
 	Buffer step_buffer;
     int mothership_offset;
     Mothership* mothership = nullptr;
-    std::vector<Graph> graphs;
+    Buffer config_path; // zero-terminated, empty if the configuration is not known
+    std::vector<Map_entry> maps;
+    std::mutex maps_mutex;
+    std::condition_variable maps_loaded;
+    std::vector<std::thread> map_loaders;
+    bool maps_closing = false;
+    int maps_pending = 0;
+    double maps_load_start = 0.0;
+    double maps_load_sum = 0.0;
 
     std::thread stdin_listener;
 };
@@ -156,6 +156,11 @@ Server::Server(Server_options const& op): options{op} {
         }
         jerr << "Using configuration: " << general_buffer.data() + config << '\n';
 
+        config_path.append(op.massim_loc);
+        config_path.append("\\server\\");
+        config_path.append(general_buffer.data() + config);
+        config_path.append0();
+
         int cmdline = general_buffer.size();
         general_buffer.append("java -jar ");
         general_buffer.append(general_buffer.data() + package);
@@ -182,6 +187,12 @@ Server::Server(Server_options const& op): options{op} {
 }
 
 Server::~Server() {
+    {
+        std::lock_guard<std::mutex> lock {maps_mutex};
+        maps_closing = true;
+    }
+    for (auto& i: map_loaders) i.join();
+    
     if (stdin_listener.joinable() and stdin_listener.get_id() != std::this_thread::get_id()) {
         cancel_blocking_io(stdin_listener);
         std::cin.setstate(std::ios_base::failbit);  
@@ -191,24 +202,137 @@ Server::~Server() {
     }
 }
 
-bool Server::load_maps() {
+bool list_maps(Buffer_view massim_loc, Buffer* names) {
+    assert(names);
     WIN32_FIND_DATA find_data;
     HANDLE handle = nullptr;
 
-    general_buffer.reserve(2048);
+    Buffer pattern;
+    pattern.append(massim_loc);
+    pattern.append("\\server\\graphs\\*");
+    pattern.append0();
+
+    handle = FindFirstFile(pattern.data(), &find_data);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+
+    do {
+        if (std::strcmp(find_data.cFileName, "." ) == 0) continue;
+        if (std::strcmp(find_data.cFileName, "..") == 0) continue;
+        if (not (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) continue;
+        names->append(find_data.cFileName, std::strlen(find_data.cFileName) + 1);
+    } while (FindNextFile(handle, &find_data));
+    
+    auto err_code = GetLastError();
+    assert_win(err_code == ERROR_NO_MORE_FILES);
+    
+    FindClose(handle);
+    return true;
+}
+
+void append_map_path(Buffer_view massim_loc, c_str map, c_str file, Buffer* into) {
+    assert(into);
+    into->append(massim_loc);
+    into->append("\\server\\graphs\\");
+    into->append(map);
+    into->append("\\");
+    into->append(file);
+    into->append0();
+}
 
+bool read_map_bounds(Buffer_view config_path, c_str map, Graph_options* options) {
+    assert(map and options);
+    if (not file_exists(config_path)) return false;
+    Buffer text;
+    text.read_from_file(config_path, false);
+
+    // This is not a JSON parser, it only tracks the objects and the keys we are interested in
+    constexpr int bound_count = 4;
+    c_str bound_keys[bound_count] = {"minLat", "maxLat", "minLon", "maxLon"};
+    struct Object {
+        bool on_map = false;
+        u8 found = 0;
+        double bounds[bound_count];
+    };
+    std::vector<Object> objects;
+    Buffer_view key;
+    bool any = false;
+    
+    char const* p = text.begin();
+    char const* end = text.end();
+    while (p < end) {
+        if (*p == '"') {
+            char const* str_begin = ++p;
+            while (p < end and *p != '"') p += *p == '\\' ? 2 : 1;
+            Buffer_view str {str_begin, (int)(std::min(p, end) - str_begin)};
+            ++p;
+            while (p < end and std::isspace((unsigned char)*p)) ++p;
+            if (p < end and *p == ':') {
+                key = str;
+                ++p;
+            } else {
+                if (key == "map" and objects.size() and str == map) {
+                    objects.back().on_map = true;
+                }
+                key = nullptr;
+            }
+        } else if (*p == '{') {
+            objects.emplace_back();
+            key = nullptr;
+            ++p;
+        } else if (*p == '}') {
+            if (objects.size()) {
+                Object o = objects.back();
+                objects.pop_back();
+                if (o.on_map and o.found == (1 << bound_count) - 1) {
+                    if (not any) {
+                        options->crop_min_lat = o.bounds[0];
+                        options->crop_max_lat = o.bounds[1];
+                        options->crop_min_lon = o.bounds[2];
+                        options->crop_max_lon = o.bounds[3];
+                    } else {
+                        options->crop_min_lat = std::min(options->crop_min_lat, o.bounds[0]);
+                        options->crop_max_lat = std::max(options->crop_max_lat, o.bounds[1]);
+                        options->crop_min_lon = std::min(options->crop_min_lon, o.bounds[2]);
+                        options->crop_max_lon = std::max(options->crop_max_lon, o.bounds[3]);
+                    }
+                    any = true;
+                }
+            }
+            key = nullptr;
+            ++p;
+        } else if (*p == '-' or ('0' <= *p and *p <= '9')) {
+            // The text is not zero-terminated, so copy the number first
+            char num[64];
+            int num_size = 0;
+            while (p < end and num_size + 1 < (int)sizeof(num) and (std::strchr("+-.eE", *p)
+                    or ('0' <= *p and *p <= '9'))) {
+                num[num_size++] = *p++;
+            }
+            num[num_size] = 0;
+            for (int i = 0; i < bound_count; ++i) {
+                if (key == bound_keys[i] and objects.size()) {
+                    objects.back().bounds[i] = std::strtod(num, nullptr);
+                    objects.back().found |= 1 << i;
+                }
+            }
+            key = nullptr;
+        } else {
+            ++p;
+        }
+    }
+
+    options->crop = options->crop or any;
+    return any;
+}
+
+bool Server::load_maps() {
     if (not options.massim_loc) {
         jerr << "Error: Location of MASSim was not specified, but is needed to load maps.\n";
         return false;
     }
     
-    int init_off = general_buffer.size();
-    general_buffer.append(options.massim_loc);
-    general_buffer.append("\\server\\graphs\\*");
-    general_buffer.append0();
-
-    handle = FindFirstFile(general_buffer.data() + init_off, &find_data);
-    if (handle == INVALID_HANDLE_VALUE) {
+    Buffer names;
+    if (not list_maps(options.massim_loc, &names)) {
         jerr << "Warning: Could not load the maps from massim. This could happen if massim was not "
              << "run yet. lampe will probably crash, but restarting should solve the problem. "
              << "You specified the following location for the massim directory:\n";
@@ -216,56 +340,115 @@ bool Server::load_maps() {
         return true;
     }
 
-    do {
-        if (std::strcmp(find_data.cFileName, "." ) == 0) continue;
-        if (std::strcmp(find_data.cFileName, "..") == 0) continue;
-        if (not (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) continue;
+    jout << "Found maps:";
+    for (c_str name = names.begin(); name < names.end(); name += std::strlen(name) + 1) {
+        maps.emplace_back();
+        maps.back().name.append(name, std::strlen(name) + 1);
+        if (options.crop_maps and config_path.size()) {
+            read_map_bounds(config_path, name, &maps.back().graph_options);
+        }
+        maps.back().graph_options.reorder = options.reorder_nodes;
+        maps.back().graph_options.hub_label_max_mb = options.hub_label_max_mb;
+        maps.back().graph_options.hub_label_max_seconds = options.hub_label_max_seconds;
+        jout << ' ' << name;
+    }
+    jout << endl;
+
+    if (options.preload_maps) {
+        // Each graph has its own memory, so maps can be loaded independently
+        int threads = std::min((int)std::max(std::thread::hardware_concurrency(), 1u), (int)maps.size());
+        maps_pending = maps.size();
+        maps_load_start = elapsed_time();
+        for (int i = 0; i < threads; ++i) {
+            map_loaders.emplace_back(&Server::preload_maps, this);
+        }
+    }
+    return true;
+}
 
-        jout << "Loading map " << find_data.cFileName << "... ";
-        jout.flush();
-        
-        int nodes_offset  = general_buffer.size();
-        general_buffer.append(options.massim_loc);
-        general_buffer.append("\\server\\graphs\\");
-        general_buffer.append(find_data.cFileName);
-        general_buffer.append("\\");
-        general_buffer.append("nodes");
-        general_buffer.append0();
-
-		int edges_offset = general_buffer.size();
-		general_buffer.append(options.massim_loc);
-		general_buffer.append("\\server\\graphs\\");
-		general_buffer.append(find_data.cFileName);
-		general_buffer.append("\\");
-		general_buffer.append("edges");
-		general_buffer.append0();
-
-		int geometry_offset = general_buffer.size();
-		general_buffer.append(options.massim_loc);
-		general_buffer.append("\\server\\graphs\\");
-		general_buffer.append(find_data.cFileName);
-		general_buffer.append("\\");
-		general_buffer.append("geometry");
-		general_buffer.append0();
-        
-        graphs.emplace_back();
-        graphs.back().init(
-            find_data.cFileName,
-            general_buffer.data() + nodes_offset,
-			general_buffer.data() + edges_offset,
-			general_buffer.data() + geometry_offset
-        );
-        general_buffer.resize(nodes_offset);
-
-        jout << "Done." << endl;
-    } while (FindNextFile(handle, &find_data));
-    general_buffer.resize(init_off);
+void Server::load_map(Map_entry* map) {
+    assert(map and map->state == Map_entry::LOADING);
+    c_str name = map->name.data();
     
-    auto err_code = GetLastError();
-    assert_win(err_code == ERROR_NO_MORE_FILES);
-    
-    FindClose(handle);
-    return true;
+    // This may run on the loader thread, do not use general_buffer
+    Buffer paths;
+    int nodes_offset = paths.size();
+    append_map_path(options.massim_loc, name, "nodes", &paths);
+    int edges_offset = paths.size();
+    append_map_path(options.massim_loc, name, "edges", &paths);
+    int geometry_offset = paths.size();
+    append_map_path(options.massim_loc, name, "geometry", &paths);
+    int cache_offset = paths.size();
+    append_map_path(options.massim_loc, name, "lampe_graph.cache", &paths);
+
+    double time = elapsed_time();
+    auto graph = std::make_unique<Graph>();
+    bool cached = graph->init_cached(
+        name,
+        paths.data() + nodes_offset,
+        paths.data() + edges_offset,
+        paths.data() + geometry_offset,
+        paths.data() + cache_offset,
+        map->graph_options
+    );
+    time = elapsed_time() - time;
+
+    std::lock_guard<std::mutex> lock {maps_mutex};
+    map->graph = std::move(graph);
+    map->state = Map_entry::LOADED;
+    maps_loaded.notify_all();
+    jout << "Loaded map " << name << (cached ? " from the cache" : "") << " in "
+         << (int)(time * 1000.0) << "ms (" << map->graph->nodes().size() << " nodes"
+         << (map->graph_options.crop ? ", cropped" : "") << ')' << endl;
+    if (map->graph->has_hub_labels()) {
+        u64 entries = map->graph->hub_label_size();
+        double per_label = (double)entries / (2 * map->graph->nodes().size());
+        jout << "  hub labels: " << jup_printf("%.1f", per_label) << " entries per label, "
+             << nice_bytes(entries * sizeof(Hub)) << endl;
+    }
+
+    maps_load_sum += time;
+    if (maps_pending and --maps_pending == 0) {
+        jout << "Loaded all " << maps.size() << " maps in " 
+             << (int)((elapsed_time() - maps_load_start) * 1000.0) << "ms (" 
+             << (int)(maps_load_sum * 1000.0) << "ms in total)" << endl;
+    }
+}
+
+void Server::preload_maps() {
+    while (true) {
+        Map_entry* next = nullptr;
+        {
+            std::lock_guard<std::mutex> lock {maps_mutex};
+            if (maps_closing) return;
+            for (auto& map: maps) {
+                if (map.state == Map_entry::UNLOADED) {
+                    map.state = Map_entry::LOADING;
+                    next = &map;
+                    break;
+                }
+            }
+        }
+        if (not next) return;
+        load_map(next);
+    }
+}
+
+Graph* Server::get_map(Buffer_view name) {
+    std::unique_lock<std::mutex> lock {maps_mutex};
+    for (auto& map: maps) {
+        if (Buffer_view {map.name.data(), map.name.size() - 1} != name) continue;
+
+        if (map.state == Map_entry::UNLOADED) {
+            map.state = Map_entry::LOADING;
+            lock.unlock();
+            load_map(&map);
+            lock.lock();
+        }
+        maps_loaded.wait(lock, [&map]() { return map.state == Map_entry::LOADED; });
+        return map.graph.get();
+    }
+    return nullptr;
 }
 
 
@@ -349,6 +532,7 @@ void Server::run_simulation() {
     
     while (true) {
         int max_steps = -1;
+        Graph* graph = nullptr;
 
         for (int i = 0; i < agents().size(); ++i) {
             int mess_offset = general_buffer.size();
@@ -366,16 +550,11 @@ void Server::run_simulation() {
             // Initialize the map
             if (i == 0) {            
                 Buffer_view name = get_string_from_id(mess.simulation.map);
-                bool found = false;
-                for (Graph& graph: graphs) {
-                    if (name == graph.name()) {
-                        set_messages_graph(&graph);
-						mothership->init(&graph);
-                        found = true;
-                        break;
-                    }
-                }
-                if (not found) {
+                graph = get_map(name);
+                if (graph) {
+                    set_messages_graph(graph);
+                    mothership->init(graph);
+                } else {
                     jerr << "Error: Could not find map " << name.c_str() << '\n';
                     die(false);
                     return;
@@ -465,6 +644,11 @@ void Server::run_simulation() {
             jout << "The match has ended. Agent " << i.name.c_str() << " has a ranking of "
                  << (int)mess.ranking << " and a score of " << mess.score << '\n';
         }
+        if (graph) {
+            auto const& c = graph->pos_cache;
+            jout << "Snapping cache of the map: " << c.hits << " hits, " << c.misses << " misses ("
+                 << jup_printf("%.1f", c.hit_rate() * 100.f) << "%)\n";
+        }
 
         if (options.use_internal_server) break;
     }
@@ -701,10 +701,7 @@ void Situation::agent_goto_nl(World const& world, Dist_cache* dist_cache, u8 age
     u16 dist = agent_dist(world, dist_cache, agent, target_id);
     u32 speed = world.roles[agent].speed * 500;
 
-    u32 dist_add = std::numeric_limits<u32>::max();
-    for (auto const& i: charging_stations) {
-        dist_add = std::min(dist_add, (u32)dist_cache->lookup(target_id, i.id));
-    }
+    u32 dist_add = dist_cache->charging_km(target_id);
 
     if (dist + dist_add + speed > d.charge / 10 * speed) {
         task(agent).result.err = Task_result::OUT_OF_BATTERY;
@@ -1291,7 +1288,17 @@ void Simulation_state::init(World* world_, Buffer* sit_buffer_, int sit_offset_,
         for (auto const& i: orig().shops)             dist_cache.register_pos(i.id, i.pos);
         for (auto const& i: orig().workshops)         dist_cache.register_pos(i.id, i.pos);
         for (auto const& i: orig().storages)          dist_cache.register_pos(i.id, i.pos);
-        //dist_cache.calc_facilities();
+
+        // The same map and facilities recur in a tournament, so keep their distances on disk
+        Buffer cache;
+        bool cached = dist_cache.cache_filename(&cache);
+        if (not cached or not dist_cache.load(cache.data())) {
+            dist_cache.calc_facilities(cached ? Buffer_view {cache.data()} : Buffer_view {});
+        }
+
+        std::vector<u8> stations;
+        for (auto const& i: orig().charging_stations) stations.push_back(i.id);
+        dist_cache.calc_charging({stations.data(), (int)stations.size()});
     }
 
     dist_cache.reset();
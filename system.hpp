@@ -25,6 +25,18 @@ void stop_abort_from_printing();
  */
 bool file_exists(Buffer_view path);
 
+/**
+ * Retrieve the size and the time of the last modification of a file. The time is in some
+ * unspecified unit, only compare it for equality. Returns whether the file exists.
+ */
+bool file_stat(Buffer_view path, u64* size, u64* mtime);
+
+/**
+ * Move the file at from over the one at to, replacing it. There is always either the old or the
+ * new file at to, never a partially written one. Returns whether that succeeded.
+ */
+bool file_replace(Buffer_view from, Buffer_view to);
+
 /**
  * This cancels any pending IO operations of the thread.
  */
@@ -51,6 +63,42 @@ double elapsed_time();
  */
 void init_elapsed_time(double val = 0);
 
+/**
+ * A read-only mapping of a whole file into memory. Owns the mapping, which is released on
+ * destruction. The contents stay valid (and unchanged) until close() is called.
+ */
+class Mapped_file {
+public:
+    Mapped_file() {}
+    Mapped_file(Mapped_file const&) = delete;
+    Mapped_file(Mapped_file&& o) { *this = std::move(o); }
+    ~Mapped_file() { close(); }
+
+    Mapped_file& operator= (Mapped_file const&) = delete;
+    Mapped_file& operator= (Mapped_file&& o) {
+        std::swap(file, o.file);
+        std::swap(mapping, o.mapping);
+        std::swap(m_data, o.m_data);
+        std::swap(m_size, o.m_size);
+        return *this;
+    }
+
+    /**
+     * Map the file at path. Returns whether that succeeded; empty files cannot be mapped.
+     */
+    bool init(Buffer_view path);
+    void close();
+
+    Buffer_view data() const { return {m_data, m_size}; }
+    operator bool() const { return m_data; }
+
+private:
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    void const* m_data = nullptr;
+    int m_size = 0;
+};
+
 class Process {
 public:
     bool write_to_buffer = true;
@@ -31,6 +31,22 @@ bool file_exists(Buffer_view path) {
         and not (attrib & FILE_ATTRIBUTE_DIRECTORY);
 }
 
+// see header
+bool file_stat(Buffer_view path, u64* size, u64* mtime) {
+    assert(size and mtime);
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (not GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &info)) return false;
+
+    *size  = (u64)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+    *mtime = (u64)info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+// see header
+bool file_replace(Buffer_view from, Buffer_view to) {
+    return MoveFileEx(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+}
+
 // see header
 void cancel_blocking_io(std::thread& thread) {
     // Very dirty. Assume that threads are implemented using some kind of
@@ -68,6 +84,45 @@ void init_elapsed_time(double val) {
     elapsed_time_offset = elapsed_time() - val;
 }
 
+bool Mapped_file::init(Buffer_view path) {
+    close();
+
+    file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    if (not GetFileSizeEx(file, &size) or size.QuadPart <= 0
+            or size.QuadPart > std::numeric_limits<int>::max()) {
+        close();
+        return false;
+    }
+    
+    mapping = CreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (not mapping) {
+        close();
+        return false;
+    }
+
+    m_data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (not m_data) {
+        close();
+        return false;
+    }
+    m_size = (int)size.QuadPart;
+    return true;
+}
+
+void Mapped_file::close() {
+    if (m_data) assert_win(UnmapViewOfFile(m_data));
+    if (mapping) assert_win(CloseHandle(mapping));
+    if (file != INVALID_HANDLE_VALUE) assert_win(CloseHandle(file));
+    file = INVALID_HANDLE_VALUE;
+    mapping = nullptr;
+    m_data = nullptr;
+    m_size = 0;
+}
+
 void Process::init(const char* cmdline, const char* dir) {
     assert(cmdline);
     assert(!*this);
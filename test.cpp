@@ -119,6 +119,293 @@ void test_jdbg_diff() {
     jdbg_diff(b, a);}
 }
 
+/**
+ * The paths of the files of a map, as passed to Graph::init and Graph::init_cached
+ */
+struct Map_files {
+    Buffer paths;
+    int nodes_offset, edges_offset, geometry_offset, cache_offset;
+
+    c_str nodes()    const { return paths.data() + nodes_offset; }
+    c_str edges()    const { return paths.data() + edges_offset; }
+    c_str geometry() const { return paths.data() + geometry_offset; }
+    c_str cache()    const { return paths.data() + cache_offset; }
+};
+
+/**
+ * Call fn(name, files, graph) for each map in massim_loc, with its graph loaded through the cache
+ * the same way the server does. Returns whether there were any maps.
+ */
+template <typename Fn>
+static bool for_each_map(Buffer_view massim_loc, Fn fn) {
+    Buffer names;
+    if (not list_maps(massim_loc, &names)) {
+        jerr << "Error: Could not find any maps in " << massim_loc.c_str() << '\n';
+        return false;
+    }
+
+    Map_files files;
+    for (c_str name = names.begin(); name < names.end(); name += std::strlen(name) + 1) {
+        files.paths.reset();
+        files.nodes_offset = files.paths.size();
+        append_map_path(massim_loc, name, "nodes", &files.paths);
+        files.edges_offset = files.paths.size();
+        append_map_path(massim_loc, name, "edges", &files.paths);
+        files.geometry_offset = files.paths.size();
+        append_map_path(massim_loc, name, "geometry", &files.paths);
+        files.cache_offset = files.paths.size();
+        append_map_path(massim_loc, name, "lampe_graph.cache", &files.paths);
+
+        Graph graph;
+        graph.init_cached(name, files.nodes(), files.edges(), files.geometry(), files.cache());
+        fn(name, files, graph);
+        tmp_alloc_reset();
+    }
+    return true;
+}
+
+void bench_graph_load(Buffer_view massim_loc, int repetitions) {
+    // The cache has been written by for_each_map if it was missing
+    for_each_map(massim_loc, [repetitions](c_str name, Map_files const& files, Graph& graph) {
+        double parse_min = std::numeric_limits<double>::max(), parse_sum = 0.0;
+        for (int i = 0; i < repetitions; ++i) {
+            double t = elapsed_time();
+            graph.init(name, files.nodes(), files.edges(), files.geometry());
+            t = elapsed_time() - t;
+            parse_min = std::min(parse_min, t);
+            parse_sum += t;
+        }
+        int nodes = graph.nodes().size();
+        int edges = graph.edges().size();
+        int bytes = graph.data().size();
+
+        double cache_min = std::numeric_limits<double>::max(), cache_sum = 0.0;
+        for (int i = 0; i < repetitions; ++i) {
+            double t = elapsed_time();
+            graph.init_cached(name, files.nodes(), files.edges(), files.geometry(), files.cache());
+            t = elapsed_time() - t;
+            cache_min = std::min(cache_min, t);
+            cache_sum += t;
+        }
+
+        jout << jup_printf("%-12s %8d nodes %8d edges %12s | parse min %8.2fms avg %8.2fms | cached"
+            " min %8.2fms avg %8.2fms\n", name, nodes, edges, nice_bytes(bytes),
+            parse_min * 1000.0, parse_sum / repetitions * 1000.0,
+            cache_min * 1000.0, cache_sum / repetitions * 1000.0);
+    });
+}
+
+/**
+ * Return the position of a random node of the graph, moved a bit so that it may also snap to an
+ * edge.
+ */
+static Pos random_graph_pos(Graph const& graph) {
+    while (true) {
+        auto const& node = graph.nodes()[rand() % graph.nodes().size()];
+        if (node.edge == edge_invalid) continue;
+        return {(u16)(node.pos.lat + rand() % 64 - 32), (u16)(node.pos.lon + rand() % 64 - 32)};
+    }
+}
+
+void bench_dist_road(Buffer_view massim_loc, int queries) {
+    // An edge as GraphHopper stores it, which the searches used to walk through
+    constexpr int gh_edge_size = 8 * sizeof(u32);
+
+    for_each_map(massim_loc, [=](c_str name, Map_files const& files, Graph& graph) {
+        srand(42);
+        std::vector<Pos> points;
+        for (int i = 0; i < 2 * queries; ++i) points.push_back(random_graph_pos(graph));
+        std::vector<Graph_position> positions;
+        double snap_time = elapsed_time();
+        for (Pos p: points) positions.push_back(graph.pos(p));
+        snap_time = elapsed_time() - snap_time;
+
+        // The grid has to find the same nearest nodes as a scan over all nodes with edges. Both
+        // measure with dist_air_batch, which may round differently from dist_air.
+        std::vector<u32> scan_ids;
+        std::vector<u16> scan_lat, scan_lon;
+        for (u32 i = 0; i < (u32)graph.nodes().size(); ++i) {
+            auto const& node = graph.nodes()[i];
+            if (node.edge == edge_invalid) continue;
+            scan_ids.push_back(i);
+            scan_lat.push_back(node.pos.lat);
+            scan_lon.push_back(node.pos.lon);
+        }
+        std::vector<float> scan_dist (scan_ids.size());
+        for (Pos p: points) {
+            constexpr int count = 8;
+            std::pair<float, u32> grid[count], scan[count];
+            graph.nearest_nodes(p, grid, count);
+            for (auto& i: scan) i = { std::numeric_limits<float>::max(), node_invalid };
+            graph.dist_air_batch(p, scan_lat.data(), scan_lon.data(), scan_ids.size(), scan_dist.data());
+            for (u32 i = 0; i < scan_ids.size(); ++i) {
+                std::pair<float, u32> c = { scan_dist[i], scan_ids[i] };
+                if (c < scan[count - 1]) {
+                    scan[count - 1] = c;
+                    std::sort(scan, scan + count);
+                }
+            }
+            assert(std::equal(grid, grid + count, scan));
+        }
+
+        Search_stats stats;
+        std::vector<u32> road_dist (queries);
+        double road_time = elapsed_time();
+        for (int i = 0; i < queries; ++i) {
+            road_dist[i] = graph.dist_road(positions[2 * i], positions[2 * i + 1], nullptr, &stats);
+        }
+        road_time = elapsed_time() - road_time;
+
+        // A block of the many-to-many table has to match dist_road pair by pair
+        int block = std::min(queries, 16);
+        std::vector<u32> table (block * block);
+        graph.dist_table({positions.data(), block}, {positions.data() + block, block}, table.data());
+        for (int i = 0; i < block; ++i) {
+            for (int j = 0; j < block; ++j) {
+                assert(table[i * block + j] == graph.dist_road(positions[i], positions[block + j]));
+            }
+        }
+
+        // The same queries on hub labels, which have to give the same distances
+        Graph_options label_options;
+        label_options.hub_label_max_mb = 1024;
+        Graph labelled;
+        labelled.init(name, files.nodes(), files.edges(), files.geometry(), label_options);
+        double label_time = elapsed_time();
+        for (int i = 0; i < queries; ++i) {
+            u32 d = labelled.dist_labels(positions[2 * i], positions[2 * i + 1]);
+            assert(d == road_dist[i]);
+        }
+        label_time = elapsed_time() - label_time;
+
+        // The bytes touched are not measured, they are estimated from the counters and the record
+        // sizes of each layout. Each settled node reads two index entries of the hierarchy and each
+        // arc one Arc. Before, each arc was a step through the linked list of edges, plus the Node
+        // of its target.
+        u64 nedges = graph.edges_hot().size();
+        u64 bytes_before = stats.arcs * gh_edge_size + stats.settled * sizeof(Node)
+            + stats.edges * gh_edge_size + stats.arcs * sizeof(Node);
+        u64 bytes_after = stats.arcs * sizeof(Arc) + stats.settled * 2 * sizeof(u32)
+            + stats.edges * sizeof(Edge_hot);
+        // Snapping used to look at the endpoints of all edges. Now it reads the nodes of about 3x3
+        // cells of the grid, and the edges of the 8 nearest nodes.
+        u64 nnodes = graph.nodes().size();
+        u64 snap_before = nedges * gh_edge_size;
+        u64 snap_after = 9 * (nnodes / (graph.pos_grid_rows * graph.pos_grid_cols) + 1) * sizeof(Node)
+            + 8 * (2 * nedges / nnodes + 1) * sizeof(Edge_hot);
+
+        jout << jup_printf("%-12s dist_road %8.3fms %8.0f settled %8.0f arcs | est. touched %10s"
+            " before %10s after | pos %8.3fms, est. touched %10s before %10s after\n", name,
+            road_time / queries * 1000.0, (double)stats.settled / queries,
+            (double)stats.arcs / queries, nice_bytes(bytes_before / queries),
+            nice_bytes(bytes_after / queries), snap_time / (2 * queries) * 1000.0,
+            nice_bytes(snap_before), nice_bytes(snap_after));
+        jout << jup_printf("%-12s dist_labels %8.3fms, labels %s\n", name,
+            label_time / queries * 1000.0, labelled.has_hub_labels()
+            ? nice_bytes(labelled.hub_label_size() * sizeof(Hub)) : "not built");
+    });
+}
+
+void bench_queue(Buffer_view massim_loc, int searches) {
+    for_each_map(massim_loc, [searches](c_str name, Map_files const&, Graph& graph) {
+        srand(42);
+        u32 nnodes = graph.nodes().size();
+        std::vector<u32> sources;
+        for (int i = 0; i < searches; ++i) sources.push_back(rand() % nnodes);
+        std::vector<u32> dist (nnodes);
+
+        // The same full dijkstras over all arcs, once with each queue. Each insert, decrease and
+        // removal counts as one operation.
+        u64 set_ops = 0, set_sum = 0;
+        double set_time = elapsed_time();
+        for (u32 source: sources) {
+            std::fill(dist.begin(), dist.end(), dist_invalid);
+            auto ring = std::set<std::pair<u32, u32>>();
+            ring.insert({ dist[source] = 0, source });
+            while (not ring.empty()) {
+                u32 node = ring.begin()->second;
+                ring.erase(ring.begin());
+                set_sum += dist[node];
+                ++set_ops;
+                for (auto const& arc: graph.arcs_out(node)) {
+                    u32 d = dist[node] + arc.dist;
+                    if (d >= dist[arc.node]) continue;
+                    if (dist[arc.node] != dist_invalid) ring.erase({ dist[arc.node], arc.node });
+                    ring.insert({ dist[arc.node] = d, arc.node });
+                    ++set_ops;
+                }
+            }
+        }
+        set_time = elapsed_time() - set_time;
+
+        u64 heap_ops = 0, heap_sum = 0;
+        Dist_heap heap;
+        double heap_time = elapsed_time();
+        for (u32 source: sources) {
+            std::fill(dist.begin(), dist.end(), dist_invalid);
+            heap.reset(nnodes);
+            heap.push(source, dist[source] = 0);
+            while (not heap.empty()) {
+                u32 node = heap.pop().node;
+                heap_sum += dist[node];
+                ++heap_ops;
+                for (auto const& arc: graph.arcs_out(node)) {
+                    u32 d = dist[node] + arc.dist;
+                    if (d >= dist[arc.node]) continue;
+                    heap.push(arc.node, dist[arc.node] = d);
+                    ++heap_ops;
+                }
+            }
+        }
+        heap_time = elapsed_time() - heap_time;
+        assert(set_sum == heap_sum);
+
+        jout << jup_printf("%-12s %8d nodes | std::set %8.2f Mops/s %8.3fms per search | Dist_heap"
+            " %8.2f Mops/s %8.3fms per search\n", name, nnodes, set_ops / set_time / 1e6,
+            set_time / searches * 1000.0, heap_ops / heap_time / 1e6,
+            heap_time / searches * 1000.0);
+    });
+}
+
+void bench_dist_air(Buffer_view massim_loc, int queries) {
+    for_each_map(massim_loc, [queries](c_str name, Map_files const&, Graph& graph) {
+        srand(42);
+        int nnodes = graph.nodes().size();
+        std::vector<Pos> from;
+        for (int i = 0; i < queries; ++i) from.push_back(random_graph_pos(graph));
+        std::vector<u16> lat, lon;
+        for (auto const& node: graph.nodes()) {
+            lat.push_back(node.pos.lat);
+            lon.push_back(node.pos.lon);
+        }
+        std::vector<float> single (nnodes), batch (nnodes);
+
+        // From each position to all nodes, once a node at a time and once as a batch
+        double sum = 0.0, single_time = 0.0, batch_time = 0.0;
+        float max_error = 0.f;
+        for (Pos a: from) {
+            double t = elapsed_time();
+            for (int i = 0; i < nnodes; ++i) single[i] = graph.dist_air(a, graph.nodes()[i].pos);
+            single_time += elapsed_time() - t;
+
+            t = elapsed_time();
+            graph.dist_air_batch(a, lat.data(), lon.data(), nnodes, batch.data());
+            batch_time += elapsed_time() - t;
+
+            for (int i = 0; i < nnodes; ++i) {
+                sum += batch[i];
+                max_error = std::max(max_error, std::abs(batch[i] - single[i]) / std::max(single[i], 1.f));
+            }
+        }
+        assert(max_error < 1e-6f);
+
+        u64 count = (u64)queries * nnodes;
+        jout << jup_printf("%-12s %8d nodes | dist_air %8.3fns | dist_air_batch %8.3fns | max "
+            "relative error %.2g, sum %.0f\n", name, nnodes, single_time / count * 1e9,
+            batch_time / count * 1e9, max_error, sum);
+    });
+}
+
 void Mothership_test::init(Graph* g) {
 	graph = g;
 }
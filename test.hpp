@@ -7,7 +7,31 @@
 namespace jup {
 
 void test_jdbg_diff();
-    
+
+/**
+ * Measure how long it takes to load each map of the MASSim installation at massim_loc, both from
+ * the GraphHopper files and from the graph cache.
+ */
+void bench_graph_load(Buffer_view massim_loc, int repetitions = 5);
+
+/**
+ * Run random dist_road queries on each map and report their time and the number of bytes of graph
+ * data they touch, compared to the layout with 32 byte edges that are chained into linked lists.
+ */
+void bench_dist_road(Buffer_view massim_loc, int queries = 1000);
+
+/**
+ * Run full dijkstra searches from random nodes of each map, once with a std::set and once with a
+ * Dist_heap as the queue, and report the queue operations per second of both.
+ */
+void bench_queue(Buffer_view massim_loc, int searches = 20);
+
+/**
+ * Compute the air distance from random positions to all nodes of each map, once with dist_air and
+ * once with dist_air_batch, and report the time per distance of both.
+ */
+void bench_dist_air(Buffer_view massim_loc, int queries = 100);
+
 struct Simulation_data {
 	u8 test;
 };